@@ -1,4 +1,12 @@
-mkdir -p bin/
+mkdir -p bin/obj/
 
-gcc -o bin/zroomutil -Wall -Wextra -std=c99 -pedantic -Og -g src/*.c -lm \
+gcc -o bin/zroomutil -Wall -Wextra -std=c99 -pedantic -Og -g src/*.c -lm -pthread \
 	-Wno-unused-parameter -Wno-unused-function
+
+# libzroomutil: everything but the command line front end
+for f in common model trace; do
+	gcc -c -fPIC -pthread -o bin/obj/$f.o -Wall -Wextra -std=c99 -pedantic -Og -g src/$f.c \
+		-Wno-unused-parameter -Wno-unused-function
+done
+ar rcs bin/libzroomutil.a bin/obj/common.o bin/obj/model.o bin/obj/trace.o
+gcc -shared -o bin/libzroomutil.so bin/obj/common.o bin/obj/model.o bin/obj/trace.o -lm -pthread
@@ -7,10 +7,23 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "common.h"
 
+/* per thread: when env is set, die() returns there instead of exiting,
+ * so one thread catching its errors never redirects another's
+ */
+struct dieCatch
+{
+	jmp_buf *env;
+	char message[1024];
+};
+static pthread_key_t sgDieKey;
+static pthread_once_t sgDieOnce = PTHREAD_ONCE_INIT;
+
 /* minimal file loader
  * returns 0 on failure
  * returns pointer to loaded file on success
@@ -63,10 +76,45 @@ int savefile(const char *fn, const void *dat, const size_t sz)
 	return 1;
 }
 
+static void dieKeyCreate(void)
+{
+	pthread_key_create(&sgDieKey, free);
+}
+
+/* the calling thread's catch state; 0 if it has none and !create */
+static struct dieCatch *dieCatchGet(bool create)
+{
+	struct dieCatch *c;
+	
+	pthread_once(&sgDieOnce, dieKeyCreate);
+	if (!(c = pthread_getspecific(sgDieKey)) && create)
+	{
+		c = calloc(1, sizeof(*c));
+		pthread_setspecific(sgDieKey, c);
+	}
+	
+	return c;
+}
+
 void die(const char *fmt, ...)
 {
+	struct dieCatch *c = dieCatchGet(false);
 	va_list args;
 	
+	if (c && c->env)
+	{
+		jmp_buf *env = c->env;
+		char message[sizeof(c->message)];
+		
+		/* formatted apart, so die("%s", die_message()) passes it on */
+		va_start(args, fmt);
+			vsnprintf(message, sizeof(message), fmt, args);
+		va_end(args);
+		memcpy(c->message, message, sizeof(message));
+		c->env = 0;
+		longjmp(*env, 1);
+	}
+	
 	va_start(args, fmt);
 		vfprintf(stderr, fmt, args);
 	va_end(args);
@@ -75,6 +123,32 @@ void die(const char *fmt, ...)
 	exit(EXIT_FAILURE);
 }
 
+/* makes die() in the calling thread longjmp to env rather than exit;
+ * 0 restores exiting (other threads are unaffected either way);
+ * returns the env it replaces, so nested catches can restore it
+ */
+jmp_buf *die_catch(jmp_buf *env)
+{
+	struct dieCatch *c = dieCatchGet(env != 0);
+	jmp_buf *prev = 0;
+	
+	if (c)
+	{
+		prev = c->env;
+		c->env = env;
+	}
+	
+	return prev;
+}
+
+/* message passed to the calling thread's most recently caught die() */
+const char *die_message(void)
+{
+	struct dieCatch *c = dieCatchGet(false);
+	
+	return c ? c->message : "";
+}
+
 void Log(const char *fmt, ...)
 {
 	va_list args;
@@ -92,7 +166,7 @@ uint32_t BEr32(const void *p)
 	if (!p)
 		return 0;
 	
-	return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+	return ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
 }
 
 uint16_t BEr16(const void *p)
@@ -126,6 +200,404 @@ void BEw16(void *dst, uint16_t v)
 	b[1] = v;
 }
 
+/* 32-bit FNV-1a hash */
+uint32_t fnv1a32(const void *src, size_t len)
+{
+	const uint8_t *b = src;
+	uint32_t h = 2166136261u;
+	
+	while (len--)
+		h = (h ^ *b++) * 16777619u;
+	
+	return h;
+}
+
+/* decompressed size of Yaz0 data, or 0 if src isn't Yaz0 */
+size_t yaz0_size(const void *src, size_t len)
+{
+	const uint8_t *b = src;
+	
+	if (!b || len < 16 || memcmp(b, "Yaz0", 4))
+		return 0;
+	
+	return BEr32(b + 4);
+}
+
+/* decodes Yaz0 data into dst, which holds exactly yaz0_size() bytes;
+ * returns 0 if the stream is malformed
+ */
+int yaz0_decode(void *dst, size_t dstLen, const void *src, size_t srcLen)
+{
+	const uint8_t *s = (const uint8_t*)src + 16;
+	const uint8_t *sEnd = (const uint8_t*)src + srcLen;
+	uint8_t *d = dst;
+	uint8_t *dEnd = d + dstLen;
+	
+	if (yaz0_size(src, srcLen) != dstLen)
+		return 0;
+	
+	while (d < dEnd)
+	{
+		int bits;
+		
+		if (s >= sEnd)
+			return 0;
+		bits = *s++;
+		
+		/* eight literals in a row */
+		if (bits == 0xff && sEnd - s >= 8 && dEnd - d >= 8)
+		{
+			memcpy(d, s, 8);
+			d += 8;
+			s += 8;
+			continue;
+		}
+		
+		for (int i = 0; i < 8 && d < dEnd; ++i, bits <<= 1)
+		{
+			const uint8_t *from;
+			size_t n;
+			
+			if (bits & 0x80)
+			{
+				if (s >= sEnd)
+					return 0;
+				*d++ = *s++;
+				continue;
+			}
+			
+			if (sEnd - s < 2)
+				return 0;
+			n = s[0] >> 4;
+			from = d - (((s[0] & 0x0f) << 8) | s[1]) - 1;
+			s += 2;
+			if (!n)
+			{
+				if (s >= sEnd)
+					return 0;
+				n = *s++ + 0x12;
+			}
+			else
+				n += 2;
+			
+			if (from < (uint8_t*)dst)
+				return 0;
+			if (n > (size_t)(dEnd - d))
+				n = dEnd - d;
+			
+			/* overlapping copies repeat the bytes just written */
+			if ((size_t)(d - from) >= n)
+			{
+				memcpy(d, from, n);
+				d += n;
+			}
+			else
+			{
+				while (n--)
+					*d++ = *from++;
+			}
+		}
+	}
+	
+	return 1;
+}
+
+/* Yaz0 encoding: blocks of input search for matches on separate threads,
+ * each reaching back into the window before it, then pack in order
+ */
+#define YAZ0_WINDOW  0x1000
+#define YAZ0_MIN     3
+#define YAZ0_MAX     0x111
+#define YAZ0_BLOCK   0x10000
+#define YAZ0_HASH    (1 << 15)
+
+struct yaz0Token
+{
+	uint16_t len; /* 0 = literal */
+	uint16_t v; /* distance, or the literal byte */
+};
+
+struct yaz0Block
+{
+	size_t begin;
+	size_t end;
+	struct yaz0Token *tok;
+	size_t tokNum;
+};
+
+struct yaz0Jobs
+{
+	const uint8_t *src;
+	size_t len;
+	struct yaz0Block *block;
+	int blockNum;
+	int next;
+	int chain; /* candidates tried per position */
+	bool lazy; /* also try matching one byte later */
+	pthread_mutex_t lock;
+};
+
+/* hash chains over the last YAZ0_WINDOW positions */
+struct yaz0Finder
+{
+	const uint8_t *src;
+	size_t len;
+	size_t inserted; /* positions below this are in the chains */
+	int32_t head[YAZ0_HASH];
+	int32_t prev[YAZ0_WINDOW];
+};
+
+static uint32_t yaz0_hash(const uint8_t *p)
+{
+	return (((uint32_t)p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> 17;
+}
+
+static void yaz0_insertTo(struct yaz0Finder *f, size_t end)
+{
+	for ( ; f->inserted < end && f->inserted + YAZ0_MIN <= f->len; ++f->inserted)
+	{
+		uint32_t h = yaz0_hash(f->src + f->inserted);
+		
+		f->prev[f->inserted & (YAZ0_WINDOW - 1)] = f->head[h];
+		f->head[h] = f->inserted;
+	}
+	if (f->inserted < end)
+		f->inserted = end;
+}
+
+/* longest match for position i, no longer than limit */
+static int yaz0_find(struct yaz0Finder *f, size_t i, int limit, int chain, int *dist)
+{
+	const uint8_t *s = f->src;
+	int best = 0;
+	
+	if (limit < YAZ0_MIN)
+		return 0;
+	
+	yaz0_insertTo(f, i);
+	for (int32_t c = f->head[yaz0_hash(s + i)]
+		; c >= 0 && i - c <= YAZ0_WINDOW && chain--
+		; c = f->prev[c & (YAZ0_WINDOW - 1)]
+	)
+	{
+		int n = 0;
+		
+		if (s[c + best] != s[i + best])
+			continue;
+		
+		while (n < limit && s[c + n] == s[i + n])
+			++n;
+		
+		if (n > best)
+		{
+			best = n;
+			*dist = i - c;
+			if (best == limit)
+				break;
+		}
+	}
+	
+	return best >= YAZ0_MIN ? best : 0;
+}
+
+static void yaz0_parseBlock(struct yaz0Jobs *jobs, struct yaz0Block *b)
+{
+	struct yaz0Finder *f = malloc(sizeof(*f));
+	const uint8_t *s = jobs->src;
+	size_t i = b->begin;
+	
+	if (!f || !(b->tok = malloc((b->end - b->begin) * sizeof(*b->tok))))
+		die("failed to allocate Yaz0 encoder");
+	
+	/* matches may start in the window before the block, but not end past it */
+	f->src = s;
+	f->len = jobs->len;
+	f->inserted = b->begin > YAZ0_WINDOW ? b->begin - YAZ0_WINDOW : 0;
+	memset(f->head, -1, sizeof(f->head));
+	memset(f->prev, -1, sizeof(f->prev));
+	
+	while (i < b->end)
+	{
+		int limit = b->end - i < YAZ0_MAX ? b->end - i : YAZ0_MAX;
+		int dist = 0;
+		int n = yaz0_find(f, i, limit, jobs->chain, &dist);
+		struct yaz0Token *t = &b->tok[b->tokNum++];
+		
+		/* defer to a longer match one byte later */
+		if (n && n < limit && jobs->lazy)
+		{
+			int dist2;
+			
+			if (yaz0_find(f, i + 1, limit - 1, jobs->chain, &dist2) > n)
+				n = 0;
+		}
+		
+		if (n)
+		{
+			t->len = n;
+			t->v = dist;
+			i += n;
+		}
+		else
+		{
+			t->len = 0;
+			t->v = s[i++];
+		}
+	}
+	
+	free(f);
+}
+
+static void *yaz0_worker(void *arg)
+{
+	struct yaz0Jobs *jobs = arg;
+	
+	for (;;)
+	{
+		int i;
+		
+		pthread_mutex_lock(&jobs->lock);
+		i = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+		
+		if (i >= jobs->blockNum)
+			break;
+		
+		yaz0_parseBlock(jobs, &jobs->block[i]);
+	}
+	
+	return 0;
+}
+
+/* compresses src to a standard Yaz0 stream on up to threads threads;
+ * effort 1 (fastest) to 9 (smallest); caller frees the result
+ */
+void *yaz0_encode(const void *src, size_t len, int effort, int threads, size_t *outLen)
+{
+	struct yaz0Jobs jobs = { .src = src, .len = len };
+	pthread_t thread[64];
+	uint8_t *out = malloc(16 + len + (len + 7) / 8);
+	uint8_t *o = out;
+	uint8_t *group = 0;
+	int groupBits = 8;
+	
+	if (!out)
+		die("failed to allocate Yaz0 encoder");
+	
+	effort = effort < 1 ? 1 : effort > 9 ? 9 : effort;
+	jobs.chain = 1 << effort;
+	jobs.lazy = effort >= 4;
+	jobs.blockNum = (len + YAZ0_BLOCK - 1) / YAZ0_BLOCK;
+	jobs.block = calloc(jobs.blockNum + 1, sizeof(*jobs.block));
+	for (int i = 0; i < jobs.blockNum; ++i)
+	{
+		jobs.block[i].begin = (size_t)i * YAZ0_BLOCK;
+		jobs.block[i].end = len - jobs.block[i].begin < YAZ0_BLOCK ? len : jobs.block[i].begin + YAZ0_BLOCK;
+	}
+	
+	threads = min_int(threads, sizeof(thread) / sizeof(*thread));
+	threads = min_int(threads, jobs.blockNum);
+	pthread_mutex_init(&jobs.lock, 0);
+	if (threads <= 1)
+		yaz0_worker(&jobs);
+	else
+	{
+		/* make do with the threads that could be created */
+		for (int i = 0; i < threads; ++i)
+			if (pthread_create(&thread[i], 0, yaz0_worker, &jobs))
+				threads = i;
+		if (!threads)
+			yaz0_worker(&jobs);
+		for (int i = 0; i < threads; ++i)
+			pthread_join(thread[i], 0);
+	}
+	pthread_mutex_destroy(&jobs.lock);
+	
+	/* header */
+	memcpy(o, "Yaz0", 4);
+	o[4] = len >> 24;
+	o[5] = len >> 16;
+	o[6] = len >> 8;
+	o[7] = len;
+	memset(o + 8, 0, 8);
+	o += 16;
+	
+	/* pack every block's tokens into groups of eight */
+	for (int i = 0; i < jobs.blockNum; ++i)
+	{
+		struct yaz0Block *b = &jobs.block[i];
+		
+		for (size_t k = 0; k < b->tokNum; ++k)
+		{
+			const struct yaz0Token *t = &b->tok[k];
+			
+			if (groupBits == 8)
+			{
+				group = o++;
+				*group = 0;
+				groupBits = 0;
+			}
+			
+			if (!t->len)
+			{
+				*group |= 0x80 >> groupBits;
+				*o++ = t->v;
+			}
+			else if (t->len < 0x12)
+			{
+				*o++ = ((t->len - 2) << 4) | ((t->v - 1) >> 8);
+				*o++ = t->v - 1;
+			}
+			else
+			{
+				*o++ = (t->v - 1) >> 8;
+				*o++ = t->v - 1;
+				*o++ = t->len - 0x12;
+			}
+			groupBits += 1;
+		}
+		
+		free(b->tok);
+	}
+	free(jobs.block);
+	
+	*outLen = o - out;
+	
+	return out;
+}
+
+void buffer_write(struct buffer *b, const void *src, size_t len)
+{
+	if (!b || !len)
+		return;
+	
+	if (b->len + len > b->cap)
+	{
+		size_t cap = b->cap ? b->cap : 4096;
+		
+		while (cap < b->len + len)
+			cap *= 2;
+		
+		if (!(b->data = realloc(b->data, cap)))
+			die("failed to grow buffer to %zu bytes", cap);
+		b->cap = cap;
+	}
+	
+	memcpy(b->data + b->len, src, len);
+	b->len += len;
+}
+
+void buffer_free(struct buffer *b)
+{
+	if (!b)
+		return;
+	
+	free(b->data);
+	b->data = 0;
+	b->len = 0;
+	b->cap = 0;
+}
+
 void *Memdup(const void *src, size_t len)
 {
 	void *dst = malloc(len);
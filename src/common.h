@@ -10,10 +10,13 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <setjmp.h>
 
 void *loadfile(const char *fn, size_t *sz);
 int savefile(const char *fn, const void *dat, const size_t sz);
 void die(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+jmp_buf *die_catch(jmp_buf *env);
+const char *die_message(void);
 void Log(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void *Memdup(const void *src, size_t len);
 char *Strdup(const char *str);
@@ -24,6 +27,22 @@ uint8_t BEr8(const void *p);
 
 void BEw16(void *dst, uint16_t v);
 
+uint32_t fnv1a32(const void *src, size_t len);
+
+size_t yaz0_size(const void *src, size_t len);
+int yaz0_decode(void *dst, size_t dstLen, const void *src, size_t srcLen);
+void *yaz0_encode(const void *src, size_t len, int effort, int threads, size_t *outLen);
+
+/* growable byte buffer */
+struct buffer
+{
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+};
+void buffer_write(struct buffer *b, const void *src, size_t len);
+void buffer_free(struct buffer *b);
+
 int min_int(const int a, const int b);
 int max_int(const int a, const int b);
 int min4_int(const int a, const int b, const int c, const int d);
@@ -5,13 +5,26 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L /* clock_gettime, sockets */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdbool.h>
+#include <time.h>
+#include <math.h>
+#include <setjmp.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define HAS_SOCKETS 1
+#endif
 
 #include "common.h"
 #include "model.h"
+#include "trace.h"
 
 #define PROGNAME "zroomutil"
 
@@ -21,80 +34,907 @@ static void showargs(void)
 	Log("arguments (order matters; each argument is a command):");
 	Log(ARG "--import file.zroom - imports a room file");
 	Log(ARG "                      (when used multiple times, rooms are concatenated)");
+	Log(ARG "--import-obj file.obj - imports a Wavefront model (each g or o starts");
+	Log(ARG "                        a group; polygons are triangulated)");
+	Log(ARG "--import-rom rom.z64 - imports every room in a rom image, decoding");
+	Log(ARG "                       them in parallel without extracting files");
+	Log(ARG "                       (or some, by dma table index, e.g. 'rom.z64:1130,1132')");
+	Log(ARG "--scale 100 - multiplies positions from --import-obj by 100 before");
+	Log(ARG "              rounding them to integers (must precede --import-obj)");
+	Log(ARG "--info file.zroom - summarizes a room file without loading it");
 	Log(ARG "--flatten - merges all groups into one");
+	Log(ARG "--cleanup - removes zero-area and duplicate triangles (use before --divide)");
 	Log(ARG "--divide '4' - divides a flattened room into 4x4x4 (can be any value)");
 	Log(ARG "               (can specify multiple subdivision levels e.g. '4,3,2')");
+	Log(ARG "               (or cells per axis, fitted to the room, e.g. '8x1x8,2x2x2')");
+	Log(ARG "--divide auto-aspect:64 - divides into about 64 cells, with as many");
+	Log(ARG "                          along each axis as the room's bounds suggest");
+	Log(ARG "--divide auto - tries many division schemes, scoring each by the work");
+	Log(ARG "                it would take to draw from cameras spread through the");
+	Log(ARG "                room, then divides by the cheapest and shows the ranking");
 	Log(ARG "--wavefront out.obj - exports the result to Wavefront model file");
 	Log(ARG "--zroom out.zroom - exports the result to zroom model file");
+	Log(ARG "--benchmark file.zroom 100 - times loading a room 100 times");
+	Log(ARG "                             (and, if it is Yaz0, decompressing it");
+	Log(ARG "                              against memcpy of as many bytes)");
+	Log(ARG "--lod '0.25' far.zroom - exports a copy with each group simplified to a");
+	Log(ARG "                         quarter of its triangles, keeping borders intact");
+	Log(ARG "                         (optional error bound in world units e.g. '0.25,50';");
+	Log(ARG "                          with a ratio of 0, only the error bound applies)");
+	Log(ARG "--query queries.txt answers.txt - answers spatial queries, one per line:");
+	Log(ARG "                                  'ray x y z dx dy dz [maxdist]',");
+	Log(ARG "                                  'box x0 y0 z0 x1 y1 z1', or");
+	Log(ARG "                                  'nearest x y z [maxdist]'");
+	Log(ARG "                                  (triangles are numbered as in --wavefront)");
+	Log(ARG "--cullpath camera.txt report.txt - replays a camera path against the");
+	Log(ARG "                                   groups' bounding boxes, reporting what");
+	Log(ARG "                                   each frame would draw; one camera per");
+	Log(ARG "                                   line: 'x y z tx ty tz [fovy aspect near");
+	Log(ARG "                                   far]' (default 60 1.333 10 12800)");
+	Log(ARG "--trace out.json - records a timeline of the commands that follow, in");
+	Log(ARG "                   chrome trace-event format (written on exit)");
+	Log(ARG "--threads 4 - compiles with 4 threads (default 0 = one per cpu)");
+	Log(ARG "--serve [path.sock] - runs as a server, reading one line of commands per");
+	Log(ARG "                      request from stdin (or a unix socket), and answering");
+	Log(ARG "                      'ok <ms>' or 'error <ms>: <message>' for each;");
+	Log(ARG "                      '--room name' selects which in-memory room the");
+	Log(ARG "                      commands that follow act on; '--drop name' frees");
+	Log(ARG "                      one; '--list' shows them; '--quit' stops the server");
+	Log(ARG "--yaz0 5 - Yaz0-compresses zroom output that follows, at effort 5");
+	Log(ARG "           (1 = fastest to 9 = smallest; 0 = uncompressed)");
+	Log(ARG "--material-deltas - zroom output that follows switches materials");
+	Log(ARG "                    by inlining only the commands that change");
+	Log(ARG "--clusters - zroom output that follows splits each group into");
+	Log(ARG "             clusters, each skipped by the rsp when out of view");
+	Log(ARG "--layout - zroom output that follows starts vertex runs and display");
+	Log(ARG "           lists on 16-byte cache lines, keeps nearby groups together");
+	Log(ARG "           in the file, and reports the padding this costs");
+	Log(ARG "           (these three take an optional 'off', e.g. '--layout off')");
+	Log(ARG "--snapshot name - remembers the room as it is now, without copying it");
+	Log(ARG "--restore name - goes back to a snapshot, e.g. to export another");
+	Log(ARG "                 division of the same flattened room");
+	Log(ARG "--budget 256 - streaming mode: keeps at most 256 MiB of triangles in memory");
+	Log(ARG "               (imports are spilled to disk, and --zroom divides and exports");
+	Log(ARG "                one cell at a time; must precede --import)");
 	exit(EXIT_FAILURE);
 }
 
-int main(int argc, char *argv[])
+/* a room remembered by --snapshot */
+struct snapshot
+{
+	struct snapshot *next;
+	char *name;
+	struct room *room;
+};
+
+/* state the commands act on */
+struct session
 {
-	struct room *room = 0;
+	struct room *room;
+	struct snapshot *snapshot;
+	struct room_bvh *bvh; /* built by --query, until another command runs */
+	size_t budget;
+	float scale; /* for --import-obj; 0 = 1 */
+	struct room_writeOptions write; /* for zroom output, and --threads */
+	struct room_division div[256]; // surely no one will nest this many divisions...
+	int divNum;
+};
+
+/* a session kept in memory by the server */
+struct namedSession
+{
+	struct namedSession *next;
+	char *name;
+	struct session s;
+};
+
+static bool serveFile(FILE *in, FILE *out);
+
+static void freeSession(struct session *s)
+{
+	struct snapshot *next = 0;
 	
-	Log("welcome to " PROGNAME);
+	for (struct snapshot *snap = s->snapshot; snap; snap = next)
+	{
+		next = snap->next;
+		room_free(snap->room);
+		free(snap->name);
+		free(snap);
+	}
 	
-	if (argc < 2)
-		showargs();
+	room_free(s->room);
+	room_bvhFree(s->bvh);
+}
+
+static double nowMs(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* answers each query in infn, writing one line per query to outfn */
+static void answerQueries(struct room_bvh *bvh, const char *infn, const char *outfn)
+{
+	FILE *in = fopen(infn, "r");
+	FILE *out = fopen(outfn, "w");
+	char line[1024];
+	int lineNum = 0;
+	int queries = 0;
+	int hits = 0;
+	
+	if (!in || !out)
+	{
+		if (in)
+			fclose(in);
+		if (out)
+			fclose(out);
+		die("failed to open '%s' or '%s'", infn, outfn);
+	}
+	
+	while (fgets(line, sizeof(line), in))
+	{
+		char kind[16];
+		float f[7];
+		int fNum;
+		
+		++lineNum;
+		if (sscanf(line, "%15s", kind) != 1 || *kind == '#')
+			continue;
+		
+		fNum = sscanf(line, "%*s %f %f %f %f %f %f %f"
+			, &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6]
+		);
+		
+		if (!strcmp(kind, "ray") && (fNum == 6 || fNum == 7))
+		{
+			struct room_hit hit;
+			
+			if (room_bvhRaycast(bvh, f, f + 3, fNum == 7 ? f[6] : INFINITY, &hit))
+			{
+				fprintf(out, "hit %g %g %g %g %d\n", hit.dist, hit.pos[0], hit.pos[1], hit.pos[2], hit.tri);
+				++hits;
+			}
+			else
+				fprintf(out, "miss\n");
+		}
+		else if (!strcmp(kind, "nearest") && (fNum == 3 || fNum == 4))
+		{
+			struct room_hit hit;
+			
+			if (room_bvhNearest(bvh, f, fNum == 4 ? f[3] : INFINITY, &hit))
+			{
+				fprintf(out, "hit %g %g %g %g %d\n", hit.dist, hit.pos[0], hit.pos[1], hit.pos[2], hit.tri);
+				++hits;
+			}
+			else
+				fprintf(out, "miss\n");
+		}
+		else if (!strcmp(kind, "box") && fNum == 6)
+		{
+			int num = room_bvhOverlap(bvh, f, f + 3, 0, 0);
+			int *tri = malloc((num + 1) * sizeof(*tri));
+			
+			room_bvhOverlap(bvh, f, f + 3, tri, num);
+			fprintf(out, "%d", num);
+			for (int i = 0; i < num; ++i)
+				fprintf(out, " %d", tri[i]);
+			fprintf(out, "\n");
+			free(tri);
+			hits += num > 0;
+		}
+		else
+		{
+			fclose(in);
+			fclose(out);
+			die("%s:%d: bad query '%s'", infn, lineNum, kind);
+		}
+		
+		++queries;
+	}
+	
+	fclose(in);
+	fclose(out);
+	Log("answered %d queries (%d hit)", queries, hits);
+}
+
+/* replays each camera in infn, writing per-frame costs to outfn */
+static void replayCameraPath(struct room *room, const struct room_writeOptions *opt, const char *infn, const char *outfn)
+{
+	FILE *in = fopen(infn, "r");
+	FILE *out = fopen(outfn, "w");
+	struct room_cull *cull;
+	struct room_cullStats all;
+	struct room_cullStats sum = {0};
+	struct room_cullStats most = {0};
+	char line[1024];
+	int lineNum = 0;
+	int frames = 0;
 	
-	for (int i = 1; i < argc; ++i)
+	if (!in || !out)
+	{
+		if (in)
+			fclose(in);
+		if (out)
+			fclose(out);
+		die("failed to open '%s' or '%s'", infn, outfn);
+	}
+	
+	cull = room_cullBegin(room, opt);
+	room_cullFrame(cull, 0, &all);
+	fprintf(out, "# frame groups triangles G_VTX vertices dlbytes\n");
+	
+	while (fgets(line, sizeof(line), in))
+	{
+		struct room_camera cam = { .fovy = 60, .aspect = 4.0f / 3, .near = 10, .far = 12800 };
+		struct room_cullStats st;
+		char first[2];
+		
+		++lineNum;
+		if (sscanf(line, " %1s", first) != 1 || *first == '#')
+			continue;
+		
+		if (sscanf(line, "%f %f %f %f %f %f %f %f %f %f"
+			, &cam.pos[0], &cam.pos[1], &cam.pos[2]
+			, &cam.target[0], &cam.target[1], &cam.target[2]
+			, &cam.fovy, &cam.aspect, &cam.near, &cam.far
+		) < 6)
+		{
+			fclose(in);
+			fclose(out);
+			room_cullFree(cull);
+			die("%s:%d: bad camera", infn, lineNum);
+		}
+		
+		room_cullFrame(cull, &cam, &st);
+		fprintf(out, "%d %d %d %d %d %d\n", frames, st.groups, st.tris, st.cmds, st.loads, st.dlBytes);
+		
+#define TALLY(X) sum.X += st.X; most.X = st.X > most.X ? st.X : most.X;
+		TALLY(groups)
+		TALLY(tris)
+		TALLY(cmds)
+		TALLY(loads)
+		TALLY(dlBytes)
+#undef TALLY
+		++frames;
+	}
+	
+	fclose(in);
+	fclose(out);
+	room_cullFree(cull);
+	
+	if (!frames)
+		return;
+	
+	Log("cullpath: %d frames; per frame mean / max / whole room:", frames);
+#define REPORT(NAME, X) Log("  %-10s %10.1f %8d %8d (%.1f%% drawn)", NAME \
+	, (double)sum.X / frames, most.X, all.X \
+	, all.X ? 100.0 * sum.X / frames / all.X : 0)
+	REPORT("groups", groups);
+	REPORT("triangles", tris);
+	REPORT("G_VTX", cmds);
+	REPORT("vertices", loads);
+	REPORT("dl bytes", dlBytes);
+#undef REPORT
+}
+
+/* runs each command in argv (argv[argc] must be 0) */
+static void runCommands(struct session *s, int argc, char *argv[])
+{
+	/* loading and building bvhs follow the session's --threads too */
+	room_setThreads(s->write.threads);
+	
+	for (int i = 0; i < argc; ++i)
 	{
 		const char *a = argv[i];
 		const char *next = argv[i + 1];
+		double traceStart = trace_now();
+		int iStart = i;
+		
+		/* any other command may change the room */
+		if (s->bvh && strcmp(a, "--query"))
+		{
+			room_bvhFree(s->bvh);
+			s->bvh = 0;
+		}
 		
 		if (!strcmp(a, "--import"))
 		{
 			struct room *tmp = room_load(next);
 			
-			if (room)
-				room_merge(room, tmp);
+			if (!tmp)
+				die("%s", room_error());
+			if (s->room)
+				room_merge(s->room, tmp);
+			else
+				s->room = tmp;
+			
+			if (s->budget)
+				room_spill(s->room);
+			
+			++i;
+		}
+		else if (!strcmp(a, "--import-obj"))
+		{
+			struct room *tmp;
+			
+			if (!next)
+				die("error parsing %s", a);
+			if (!(tmp = room_loadObj(next, s->scale ? s->scale : 1)))
+				die("%s", room_error());
+			
+			if (s->room)
+				room_merge(s->room, tmp);
 			else
-				room = tmp;
+				s->room = tmp;
+			
+			if (s->budget)
+				room_spill(s->room);
 			
 			++i;
 		}
+		else if (!strcmp(a, "--import-rom"))
+		{
+			int which[256];
+			int whichNum = 0;
+			char *tmp;
+			char *list;
+			struct room *room;
+			
+			if (!next)
+				die("error parsing %s", a);
+			tmp = Strdup(next);
+			
+			/* 'rom.z64:1130,1132' picks files by dma table index */
+			if ((list = strrchr(tmp, ':'))
+				&& list[1]
+				&& strspn(list + 1, "0123456789,") == strlen(list + 1)
+			)
+			{
+				*list = '\0';
+				for (char *w = list + 1; *w; )
+				{
+					if (!isdigit(*w)
+						|| whichNum >= (int)(sizeof(which) / sizeof(*which))
+					)
+						die("error parsing %s %s", a, next);
+					which[whichNum++] = strtol(w, &w, 10);
+					if (*w == ',')
+						++w;
+				}
+			}
+			room = room_loadRom(tmp, which, whichNum);
+			free(tmp);
+			if (!room)
+				die("%s", room_error());
+			
+			if (s->room)
+				room_merge(s->room, room);
+			else
+				s->room = room;
+			
+			if (s->budget)
+				room_spill(s->room);
+			
+			++i;
+		}
+		else if (!strcmp(a, "--scale"))
+		{
+			if (!next || sscanf(next, "%f", &s->scale) != 1 || s->scale <= 0)
+				die("error parsing %s %s", a, next ? next : "");
+			++i;
+		}
 		else if (!strcmp(a, "--wavefront"))
 		{
-			room_writeWavefront(room, 0, next);
+			if (s->budget)
+				die("%s is not supported with --budget", a);
+			if (!room_writeWavefront(s->room, 0, next))
+				die("%s", room_error());
 			++i;
 		}
 		else if (!strcmp(a, "--zroom"))
 		{
-			room_writeZroom(room, next, true);
+			if (s->budget
+				? !room_writeZroomStreaming(s->room, next, true, &s->write, s->div, s->divNum, s->budget)
+				: !room_writeZroom(s->room, next, true, &s->write)
+			)
+				die("%s", room_error());
+			++i;
+		}
+		else if (!strcmp(a, "--lod"))
+		{
+			float ratio = 0;
+			float maxError = 0;
+			
+			if (!next
+				|| i + 2 >= argc
+				|| sscanf(next, "%f,%f", &ratio, &maxError) < 1
+				|| ratio < 0
+				|| ratio > 1
+				|| (ratio == 0 && maxError <= 0)
+			)
+				die("error parsing %s", a);
+			if (s->budget)
+				die("%s is not supported with --budget", a);
+			if (!room_writeZroomLod(s->room, argv[i + 2], true, &s->write, ratio, maxError))
+				die("%s", room_error());
+			i += 2;
+		}
+		else if (!strcmp(a, "--divide") && next && !strcmp(next, "auto"))
+		{
+			if (s->budget)
+				die("%s auto is not supported with --budget", a);
+			s->divNum = room_divideAuto(s->room, s->div, sizeof(s->div) / sizeof(*s->div));
+			++i;
+		}
+		else if (!strcmp(a, "--divide") && next && !strncmp(next, "auto-aspect", 11))
+		{
+			int cells = 64;
+			
+			if ((next[11] && sscanf(next + 11, ":%d", &cells) != 1) || cells < 1)
+				die("error parsing %s %s", a, next);
+			s->div[0] = room_aspectDivision(s->room, cells);
+			s->divNum = 1;
+			Log("divide auto-aspect: %dx%dx%d"
+				, s->div[0].n[0], s->div[0].n[1], s->div[0].n[2]
+			);
+			if (!s->budget)
+				room_divide(s->room, s->div, s->divNum);
 			++i;
 		}
 		else if (!strcmp(a, "--divide"))
 		{
 			char *tmp = Strdup(next);
-			int div[256]; // surely no one will nest this many divisions...
-			int divNum = 0;
 			
+			s->divNum = 0;
 			for (const char *w = tmp
-				; w && *w && divNum < (int)(sizeof(div) / sizeof(*div))
+				; w && *w && s->divNum < (int)(sizeof(s->div) / sizeof(*s->div))
 				; ++w
 			)
 			{
-				if (sscanf(w, "%d", &div[divNum]) != 1)
-					die("error parsing %s %s", a, next);
-				while (*w && isdigit(*w))
+				struct room_division *d = &s->div[s->divNum];
+				
+				int k = 0;
+				
+				/* '4' is a cube of 4x4x4, while '4x1x4' fits the bounds */
+				for (;;)
+				{
+					if (k >= 3 || sscanf(w, "%d", &d->n[k]) != 1 || d->n[k] < 1)
+						die("error parsing %s %s", a, next);
+					while (*w && isdigit(*w))
+						++w;
+					k += 1;
+					if (*w != 'x')
+						break;
 					++w;
-				divNum += 1;
+				}
+				if (k == 2)
+					die("error parsing %s %s", a, next);
+				d->cube = k == 1;
+				if (d->cube)
+					d->n[1] = d->n[2] = d->n[0];
+				s->divNum += 1;
 				if (!*w)
 					break;
 			}
-			room_divide(room, div, divNum);
-			++i;
 			free(tmp);
+			/* in streaming mode, division happens during export */
+			if (!s->budget)
+				room_divide(s->room, s->div, s->divNum);
+			++i;
+		}
+		else if (!strcmp(a, "--snapshot") || !strcmp(a, "--restore"))
+		{
+			struct snapshot *snap;
+			
+			if (!next)
+				die("%s expects a name", a);
+			if (s->budget)
+				die("%s is not supported with --budget", a);
+			
+			for (snap = s->snapshot; snap && strcmp(snap->name, next); snap = snap->next)
+				;
+			
+			if (!strcmp(a, "--restore"))
+			{
+				if (!snap)
+					die("no snapshot named '%s'", next);
+				room_free(s->room);
+				s->room = room_snapshot(snap->room);
+			}
+			else
+			{
+				if (!s->room)
+					die("nothing to snapshot");
+				if (!snap)
+				{
+					snap = calloc(1, sizeof(*snap));
+					snap->name = Strdup(next);
+					snap->next = s->snapshot;
+					s->snapshot = snap;
+				}
+				room_free(snap->room);
+				snap->room = room_snapshot(s->room);
+			}
+			++i;
 		}
 		else if (!strcmp(a, "--flatten"))
 		{
-			room_flatten(room);
+			room_flatten(s->room);
+		}
+		else if (!strcmp(a, "--cleanup"))
+		{
+			if (s->budget)
+				die("%s is not supported with --budget", a);
+			room_cleanup(s->room);
+		}
+		else if (!strcmp(a, "--query"))
+		{
+			if (!next || i + 2 >= argc)
+				die("error parsing %s", a);
+			if (s->budget)
+				die("%s is not supported with --budget", a);
+			if (!s->bvh)
+				s->bvh = room_bvhBuild(s->room);
+			answerQueries(s->bvh, next, argv[i + 2]);
+			i += 2;
+		}
+		else if (!strcmp(a, "--cullpath"))
+		{
+			if (!next || i + 2 >= argc)
+				die("error parsing %s", a);
+			if (s->budget)
+				die("%s is not supported with --budget", a);
+			replayCameraPath(s->room, &s->write, next, argv[i + 2]);
+			i += 2;
+		}
+		else if (!strcmp(a, "--info"))
+		{
+			struct room_info info;
+			
+			if (!next)
+				die("error parsing %s", a);
+			if (!room_info(next, &info))
+				die("%s", room_error());
+			Log("'%s': mesh type %d, %d entries, %d display lists (%d bytes), "
+				"%d G_VTX loading %d vertices (%d distinct), %d triangles, "
+				"%d materials, bounds %d %d %d to %d %d %d"
+				, next, info.meshType, info.entries, info.dlNum, info.dlBytes
+				, info.vtxCmds, info.vtxLoaded, info.vtxUnique, info.tris
+				, info.materials
+				, info.min[0], info.min[1], info.min[2]
+				, info.max[0], info.max[1], info.max[2]
+			);
+			++i;
+		}
+		else if (!strcmp(a, "--benchmark"))
+		{
+			int iters;
+			clock_t start;
+			double sec;
+			
+			if (!next || i + 2 >= argc || sscanf(argv[i + 2], "%d", &iters) != 1 || iters <= 0)
+				die("error parsing %s", a);
+			
+			start = clock();
+			for (int k = 0; k < iters; ++k)
+			{
+				struct room *room = room_load(next);
+				
+				if (!room)
+					die("%s", room_error());
+				room_free(room);
+			}
+			sec = (double)(clock() - start) / CLOCKS_PER_SEC;
+			
+			Log("room_load '%s': %.3f ms per iteration", next, sec * 1000 / iters);
+			
+			/* compare decompression to copying the same bytes */
+			{
+				size_t len;
+				void *data = loadfile(next, &len);
+				size_t rawLen = yaz0_size(data, len);
+				void *raw = rawLen ? malloc(rawLen) : 0;
+				void *copy = rawLen ? malloc(rawLen) : 0;
+				double mib = rawLen / (1024.0 * 1024.0) * iters;
+				double yaz0Sec;
+				
+				if (raw && copy)
+				{
+					start = clock();
+					for (int k = 0; k < iters; ++k)
+						if (!yaz0_decode(raw, rawLen, data, len))
+							die("failed to decompress Yaz0 room '%s'", next);
+					yaz0Sec = (double)(clock() - start) / CLOCKS_PER_SEC;
+					
+					start = clock();
+					for (int k = 0; k < iters; ++k)
+						memcpy(copy, raw, rawLen);
+					sec = (double)(clock() - start) / CLOCKS_PER_SEC;
+					if (memcmp(copy, raw, rawLen))
+						die("memcpy baseline mismatch");
+					
+					Log("yaz0 decode: %zu -> %zu bytes, %.1f MiB/s (memcpy %.1f MiB/s)"
+						, len, rawLen, mib / yaz0Sec, mib / sec
+					);
+				}
+				free(copy);
+				free(raw);
+				free(data);
+			}
+			i += 2;
+		}
+		else if (!strcmp(a, "--threads"))
+		{
+			int threads;
+			
+			if (!next || sscanf(next, "%d", &threads) != 1 || threads < 0)
+				die("error parsing %s %s", a, next ? next : "");
+			s->write.threads = threads;
+			room_setThreads(threads);
+			++i;
+		}
+		else if (!strcmp(a, "--yaz0"))
+		{
+			int effort;
+			
+			if (!next || sscanf(next, "%d", &effort) != 1 || effort < 0 || effort > 9)
+				die("error parsing %s %s", a, next ? next : "");
+			s->write.yaz0 = effort;
+			++i;
+		}
+		else if (!strcmp(a, "--material-deltas")
+			|| !strcmp(a, "--clusters")
+			|| !strcmp(a, "--layout")
+		)
+		{
+			bool on = true;
+			
+			/* optional 'on' or 'off' */
+			if (next && (!strcmp(next, "on") || !strcmp(next, "off")))
+			{
+				on = !strcmp(next, "on");
+				++i;
+			}
+			
+			if (!strcmp(a, "--material-deltas"))
+				s->write.materialDeltas = on;
+			else if (!strcmp(a, "--clusters"))
+				s->write.clusters = on;
+			else
+				s->write.layout = on;
+		}
+		else if (!strcmp(a, "--budget"))
+		{
+			int mib;
+			
+			if (!next || sscanf(next, "%d", &mib) != 1 || mib <= 0)
+				die("error parsing %s %s", a, next ? next : "");
+			s->budget = (size_t)mib << 20;
+			++i;
+		}
+		else if (!strcmp(a, "--serve"))
+		{
+			/* optional socket path */
+			if (next && strncmp(next, "--", 2))
+			{
+#ifdef HAS_SOCKETS
+				struct sockaddr_un addr = { .sun_family = AF_UNIX };
+				int fd;
+				
+				if (strlen(next) >= sizeof(addr.sun_path))
+					die("socket path '%s' is too long", next);
+				strcpy(addr.sun_path, next);
+				unlink(next);
+				
+				if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+					|| bind(fd, (struct sockaddr*)&addr, sizeof(addr))
+					|| listen(fd, 4)
+				)
+					die("failed to listen on '%s'", next);
+				
+				Log("serving on '%s'", next);
+				for (bool quit = false; !quit; )
+				{
+					int c = accept(fd, 0, 0);
+					FILE *in = c < 0 ? 0 : fdopen(c, "r");
+					FILE *out = c < 0 ? 0 : fdopen(dup(c), "w");
+					
+					if (c < 0)
+						break;
+					
+					if (in && out)
+						quit = serveFile(in, out);
+					if (in)
+						fclose(in);
+					if (out)
+						fclose(out);
+				}
+				close(fd);
+				unlink(next);
+#else
+				die("%s with a socket is not supported on this platform", a);
+#endif
+				++i;
+			}
+			else
+				serveFile(stdin, stdout);
+		}
+		else if (!strcmp(a, "--trace"))
+		{
+			if (!trace_open(next))
+				die("error parsing %s", a);
+			++i;
+		}
+		
+		trace_span(a, traceStart, i > iStart ? next : 0);
+	}
+}
+
+/* splits line into whitespace-separated words in place, honoring
+ * 'single' and "double" quotes; returns the number of words
+ */
+static int splitWords(char *line, char *words[], int wordsMax)
+{
+	int num = 0;
+	char *dst = line;
+	
+	for (char *src = line; *src && num < wordsMax - 1; )
+	{
+		char quote = 0;
+		
+		while (isspace((unsigned char)*src))
+			++src;
+		if (!*src)
+			break;
+		
+		words[num++] = dst;
+		for ( ; *src && (quote || !isspace((unsigned char)*src)); ++src)
+		{
+			if (quote && *src == quote)
+				quote = 0;
+			else if (!quote && (*src == '\'' || *src == '"'))
+				quote = *src;
+			else
+				*dst++ = *src;
 		}
+		if (*src)
+			++src;
+		*dst++ = '\0';
 	}
+	words[num] = 0;
+	
+	return num;
+}
+
+/* answers one request per line read from in; returns at end of input,
+ * or true on '--quit'
+ */
+static bool serveFile(FILE *in, FILE *out)
+{
+	static struct namedSession *sessions = 0;
+	static struct namedSession *current = 0;
+	char line[4096];
+	volatile bool quit = false;
+	
+	while (!quit && fgets(line, sizeof(line), in))
+	{
+		char *words[256];
+		int wordsNum = splitWords(line, words, sizeof(words) / sizeof(*words));
+		double start = nowMs();
+		jmp_buf env;
+		
+		if (!wordsNum)
+			continue;
+		
+		if (setjmp(env))
+		{
+			die_catch(0);
+			fprintf(out, "error %.3f ms: %s\n", nowMs() - start, die_message());
+			fflush(out);
+			continue;
+		}
+		die_catch(&env);
+		
+		/* server commands, with everything between them forwarded */
+		for (int i = 0, from = 0; i <= wordsNum; ++i)
+		{
+			const char *a = words[i];
+			const char *next = a ? words[i + 1] : 0;
+			bool isRoom = a && !strcmp(a, "--room");
+			bool isDrop = a && !strcmp(a, "--drop");
+			bool isList = a && !strcmp(a, "--list");
+			bool isQuit = a && !strcmp(a, "--quit");
+			
+			if (a && !isRoom && !isDrop && !isList && !isQuit)
+				continue;
+			
+			/* run what came before */
+			if (i > from)
+			{
+				char *tmp = words[i];
+				
+				if (!current)
+					die("no room selected; use --room name");
+				
+				words[i] = 0;
+				runCommands(&current->s, i - from, words + from);
+				words[i] = tmp;
+			}
+			
+			if ((isRoom || isDrop) && !next)
+				die("%s expects a name", a);
+			
+			if (isRoom)
+			{
+				struct namedSession *n;
+				
+				for (n = sessions; n && strcmp(n->name, next); n = n->next)
+					;
+				if (!n)
+				{
+					n = calloc(1, sizeof(*n));
+					n->name = Strdup(next);
+					n->next = sessions;
+					sessions = n;
+				}
+				current = n;
+				++i;
+			}
+			else if (isDrop)
+			{
+				for (struct namedSession **n = &sessions; *n; n = &(*n)->next)
+				{
+					struct namedSession *drop = *n;
+					
+					if (strcmp(drop->name, next))
+						continue;
+					
+					*n = drop->next;
+					if (current == drop)
+						current = 0;
+					freeSession(&drop->s);
+					free(drop->name);
+					free(drop);
+					break;
+				}
+				++i;
+			}
+			else if (isList)
+			{
+				for (struct namedSession *n = sessions; n; n = n->next)
+					fprintf(out, "%c %s\n", n == current ? '*' : ' ', n->name);
+			}
+			else if (isQuit)
+				quit = true;
+			
+			from = i + 1;
+		}
+		
+		die_catch(0);
+		fprintf(out, "ok %.3f ms\n", nowMs() - start);
+		fflush(out);
+	}
+	
+	return quit;
+}
+
+int main(int argc, char *argv[])
+{
+	struct session s = {0};
+	
+	Log("welcome to " PROGNAME);
+	
+	if (argc < 2)
+		showargs();
+	
+	runCommands(&s, argc - 1, argv + 1);
+	
+	freeSession(&s);
 	
-	if (room)
-		room_free(room);
+	trace_close();
 	
 	return 0;
 }
@@ -5,13 +5,23 @@
  *
  */
 
+#define _POSIX_C_SOURCE 200809L /* sysconf, mmap */
+
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "common.h"
 #include "model.h"
+#include "trace.h"
 
 // gbi stuff
 #if 1
@@ -19,13 +29,62 @@
 #define G_CULLDL        0x03
 #define G_TRI           0x05
 #define G_TRI2          0x06
+#define G_TEXTURE       0xd7
+#define G_GEOMETRYMODE  0xd9
+#define G_MOVEWORD      0xdb
+#define G_MOVEMEM       0xdc
 #define G_DL            0xde
 #define G_ENDDL         0xdf
+#define G_SETOTHERMODE_L 0xe2
+#define G_SETOTHERMODE_H 0xe3
+#define G_RDPLOADSYNC   0xe6
+#define G_RDPPIPESYNC   0xe7
+#define G_RDPTILESYNC   0xe8
+#define G_RDPFULLSYNC   0xe9
+#define G_SETKEYGB      0xea
+#define G_SETKEYR       0xeb
+#define G_SETCONVERT    0xec
+#define G_SETSCISSOR    0xed
+#define G_SETPRIMDEPTH  0xee
+#define G_LOADTLUT      0xf0
+#define G_SETTILESIZE   0xf2
+#define G_LOADBLOCK     0xf3
+#define G_LOADTILE      0xf4
+#define G_SETTILE       0xf5
+#define G_SETFILLCOLOR  0xf7
+#define G_SETFOGCOLOR   0xf8
+#define G_SETBLENDCOLOR 0xf9
+#define G_SETPRIMCOLOR  0xfa
+#define G_SETENVCOLOR   0xfb
+#define G_SETCOMBINE    0xfc
+#define G_SETTIMG       0xfd
+#define MATSTATE_MAX    32 /* distinct pieces of state a material may set */
+#define CACHE_LINE      16 /* vr4300 data cache; also a multiple of the 8-byte dma alignment */
 #define VBUF_MAX        32
+#define DL_DEPTH_MAX    10 /* rsp display list stack depth */
 #endif
 
 // private globals
-static uint8_t *sgRoomSegment = 0;
+static int sgThreads = 0; /* 0 = one per cpu */
+static const struct room_writeOptions sgWriteDefaults = {0};
+
+/* how appendDL treats each opcode */
+enum dlOp
+{
+	DLOP_MATERIAL = 0 /* anything else is material setup */
+	, DLOP_VTX
+	, DLOP_TRI
+	, DLOP_TRI2
+	, DLOP_DL
+	, DLOP_ENDDL
+};
+static const uint8_t sgDlOp[256] = {
+	[G_VTX] = DLOP_VTX
+	, [G_TRI] = DLOP_TRI
+	, [G_TRI2] = DLOP_TRI2
+	, [G_DL] = DLOP_DL
+	, [G_ENDDL] = DLOP_ENDDL
+};
 
 // private types
 #if 1
@@ -43,8 +102,10 @@ struct bbox
 struct material
 {
 	struct material *next;
+	struct material *mergedInto; /* set by room_merge on duplicates */
 	void *data;
 	int dataLen;
+	uint32_t hash;
 	uint32_t wroteAt;
 };
 
@@ -74,26 +135,49 @@ struct group
 	uint32_t wroteAt;
 };
 
+/* a room file being decoded; each decode has its own,
+ * so several rooms can be decoded at once
+ */
+struct segment
+{
+	const uint8_t *data;
+	size_t len;
+	int unfollowedDL;
+};
+
 struct room
 {
 	struct group *group;
 	struct material *mat;
+	FILE *spill; /* triangles moved out of memory by room_spill */
+	long spillNum;
+	struct bbox spillBounds;
+	int *shares; /* rooms sharing group and mat with this one, see room_snapshot */
 };
 #endif // private types
 
 // private helpers
 #if 1
-static void *segmentReadV(const uint32_t v)
+/* returns 0 unless [v, v + len) lies inside the room segment */
+static const void *segmentRangeV(const struct segment *seg, const uint32_t v, const size_t len)
 {
-	if ((v >> 24) != 0x03)
+	if ((v >> 24) != 0x03
+		|| (v & 0xffffff) > seg->len
+		|| len > seg->len - (v & 0xffffff)
+	)
 		return 0;
 	
-	return &sgRoomSegment[v & 0xffffff];
+	return &seg->data[v & 0xffffff];
+}
+
+static const void *segmentReadV(const struct segment *seg, const uint32_t v)
+{
+	return segmentRangeV(seg, v, 1);
 }
 
-static void *segmentReadP(const void *p)
+static const void *segmentReadP(const struct segment *seg, const void *p)
 {
-	return segmentReadV(BEr32(p));
+	return segmentReadV(seg, BEr32(p));
 }
 
 static void appendTri(struct group *dst, struct material *mat, struct vertex *vbuf, int a, int b, int c)
@@ -111,11 +195,7 @@ static void appendTri(struct group *dst, struct material *mat, struct vertex *vb
 static struct material *appendMaterial(struct room *dst, const uint8_t *src, int srcLen)
 {
 	struct material *mat;
-	
-	/* check whether already exists */
-	for (mat = dst->mat; mat; mat = mat->next)
-		if (mat->dataLen == srcLen && !memcmp(mat->data, src, srcLen))
-			return mat;
+	uint32_t hash;
 	
 	/* temporary test: use Hylian Shield material for everything */
 	if (true)
@@ -141,91 +221,186 @@ static struct material *appendMaterial(struct room *dst, const uint8_t *src, int
 		srcLen = sizeof(hylianShieldMaterial);
 	}
 	
+	/* the last one added is the likeliest match, and comparing
+	 * against it is cheaper than hashing
+	 */
+	if ((mat = dst->mat) && mat->dataLen == srcLen && !memcmp(mat->data, src, srcLen))
+		return mat;
+	
+	/* check whether already exists */
+	hash = fnv1a32(src, srcLen);
+	for (mat = dst->mat; mat; mat = mat->next)
+		if (mat->hash == hash && mat->dataLen == srcLen && !memcmp(mat->data, src, srcLen))
+			return mat;
+	
 	/* create new material and link into list */
 	mat = calloc(1, sizeof(*mat));
 	mat->data = Memdup(src, srcLen);
 	mat->dataLen = srcLen;
+	mat->hash = hash;
 	mat->next = dst->mat;
 	dst->mat = mat;
 	
 	return mat;
 }
 
-static void appendDL(struct room *dst, const uint8_t *src)
+/* decodes a display list, ensuring as it goes that every command,
+ * vertex load, vertex index and followed branch stays inside the room
+ * and the vertex buffer; dies describing the first problem found,
+ * leaving what was decoded so far in dst for the caller to free
+ */
+static void decodeDL(struct segment *seg, struct room *dst, struct group *group, struct material **mat, struct vertex *vbuf, const uint32_t addr, const int depth)
 {
+	const uint8_t *src = segmentRangeV(seg, addr, 8);
+	const uint8_t *end = seg->data + seg->len;
+	const uint8_t *matStart = 0;
+	const int stride = 8;
+	
 	if (!src)
-		return;
+		die("display list %08x lies outside the room", addr);
 	
-	struct vertex vbuf[VBUF_MAX] = {0};
-	struct material *mat = 0;
-	struct group *group = calloc(1, sizeof(*group));
-	const int stride = 8;
+	if (depth >= DL_DEPTH_MAX)
+		die("display list %08x nested too deeply", addr);
 	
-	while (*src != G_ENDDL)
+	for ( ; src + stride <= end; src += stride)
 	{
-		/* material */
+		enum dlOp op = sgDlOp[*src];
+		
+		/* material ends where geometry or a followed branch begins */
+		if (matStart
+			&& op != DLOP_MATERIAL
+			&& op != DLOP_ENDDL
+			&& !(op == DLOP_DL && src[4] != 0x03)
+		)
 		{
-			const uint8_t *start = src;
-			
-			while (*src != G_VTX
-				&& *src != G_TRI
-				&& *src != G_TRI2
-				&& *src != G_ENDDL
-			)
-				src += stride;
-			
-			if (src > start)
-				mat = appendMaterial(dst, start, src - start);
+			*mat = appendMaterial(dst, matStart, src - matStart);
+			matStart = 0;
 		}
 		
-		/* mesh */
-		while (*src == G_VTX
-			|| *src == G_TRI
-			|| *src == G_TRI2
-		)
+		switch (op)
 		{
-			switch (*src)
+			case DLOP_MATERIAL:
+				if (!matStart)
+					matStart = src;
+				break;
+			
+			case DLOP_VTX:
 			{
-				case G_VTX:
+				int numv = (src[1] << 4) | (src[2] >> 4);
+				int vbidx = (src[3] >> 1) - numv;
+				const uint8_t *vaddr;
+				
+				if (numv <= 0 || vbidx < 0 || vbidx + numv > VBUF_MAX)
+					die("G_VTX at %08x loads %d vertices into slot %d"
+						, 0x03000000 | (unsigned)(src - seg->data), numv, vbidx
+					);
+				if (!(vaddr = segmentRangeV(seg, BEr32(src + 4), numv * 16)))
+					die("G_VTX at %08x reads outside the room"
+						, 0x03000000 | (unsigned)(src - seg->data)
+					);
+				
+				while (numv--)
 				{
-					int numv = (src[1] << 4) | (src[2] >> 4);
-					int vbidx = (src[3] >> 1) - numv;
-					uint8_t *vaddr = segmentReadP(src + 4);
+					struct vertex *v = vbuf + vbidx;
 					
-					while (numv--)
-					{
-						struct vertex *v = vbuf + vbidx;
-						
-						memcpy(v, vaddr, 16);
-						v->x = BEr16(vaddr + 0);
-						v->y = BEr16(vaddr + 2);
-						v->z = BEr16(vaddr + 4);
-						
-						vaddr += 16;
-						vbidx += 1;
-					}
-					break;
+					memcpy(v, vaddr, 16);
+					v->x = BEr16(vaddr + 0);
+					v->y = BEr16(vaddr + 2);
+					v->z = BEr16(vaddr + 4);
+					
+					vaddr += 16;
+					vbidx += 1;
 				}
-				
-				case G_TRI:
-					appendTri(group, mat, vbuf, src[1], src[2], src[3]);
-					break;
-				
-				case G_TRI2:
-					appendTri(group, mat, vbuf, src[1], src[2], src[3]);
-					appendTri(group, mat, vbuf, src[5], src[6], src[7]);
-					break;
+				break;
 			}
 			
-			src += stride;
+			/* indices are doubled, and VBUF_MAX * 2 is a power of two,
+			 * so one of them is out of range exactly when their or is
+			 */
+			case DLOP_TRI:
+				if ((src[1] | src[2] | src[3]) >= VBUF_MAX * 2)
+					die("G_TRI at %08x uses invalid vertex index"
+						, 0x03000000 | (unsigned)(src - seg->data)
+					);
+				appendTri(group, *mat, vbuf, src[1], src[2], src[3]);
+				break;
+			
+			case DLOP_TRI2:
+				if ((src[1] | src[2] | src[3] | src[5] | src[6] | src[7]) >= VBUF_MAX * 2)
+					die("G_TRI2 at %08x uses invalid vertex index"
+						, 0x03000000 | (unsigned)(src - seg->data)
+					);
+				appendTri(group, *mat, vbuf, src[1], src[2], src[3]);
+				appendTri(group, *mat, vbuf, src[5], src[6], src[7]);
+				break;
+			
+			case DLOP_DL:
+				/* branches into other segments can't be followed;
+				 * keep them with the material as before
+				 */
+				if (src[4] != 0x03)
+				{
+					seg->unfollowedDL += 1;
+					if (!matStart)
+						matStart = src;
+					break;
+				}
+				decodeDL(seg, dst, group, mat, vbuf, BEr32(src + 4), depth + 1);
+				if (src[1]) /* branch without return */
+					return;
+				break;
+			
+			case DLOP_ENDDL:
+				return;
 		}
 	}
 	
+	die("display list %08x runs past the end of the room", addr);
+}
+
+static void appendDL(struct segment *seg, struct room *dst, const uint32_t addr)
+{
+	struct vertex vbuf[VBUF_MAX] = {0};
+	struct material *mat = 0;
+	struct group *group;
+	double traceStart;
+	
+	if (!addr)
+		return;
+	
+	if ((addr >> 24) != 0x03)
+	{
+		seg->unfollowedDL += 1;
+		return;
+	}
+	
+	traceStart = trace_now();
+	
+	/* linked first, so it is freed with dst if decoding dies */
+	group = calloc(1, sizeof(*group));
 	group->next = dst->group;
 	dst->group = group;
+	decodeDL(seg, dst, group, &mat, vbuf, addr, 0);
+	
+	trace_span("appendDL", traceStart, 0);
+}
+
+/* pads b with zeroes until at + b->len falls on a cache line,
+ * adding the bytes written to padding
+ */
+static void padToLine(struct buffer *b, size_t at, size_t *padding)
+{
+	while ((at + b->len) % CACHE_LINE)
+	{
+		buffer_write(b, "", 1);
+		*padding += 1;
+	}
 }
 
-static void writeMaterials(struct room *room, FILE *dst)
+/* dst begins at file offset base; with layout, each material
+ * starts on a cache line
+ */
+static void writeMaterials(struct room *room, struct buffer *dst, const size_t base, bool layout, size_t *padding)
 {
 	const int stride = 8;
 	const uint8_t enddl[8] = { G_ENDDL };
@@ -233,686 +408,5657 @@ static void writeMaterials(struct room *room, FILE *dst)
 	/* write every material */
 	for (struct material *m = room->mat; m; m = m->next)
 	{
-		m->wroteAt = 0x03000000 | ftell(dst);
+		if (layout)
+			padToLine(dst, base, padding);
+		m->wroteAt = 0x03000000 | (base + dst->len);
 		for (uint8_t *d = m->data; d < ((uint8_t*)m->data) + m->dataLen; d += stride)
 		{
 			if (*d != G_CULLDL
 				&& *d != G_DL
 			)
-				fwrite(d, 1, stride, dst);
+				buffer_write(dst, d, stride);
 		}
-		fwrite(enddl, 1, sizeof(enddl), dst);
+		buffer_write(dst, enddl, sizeof(enddl));
 	}
 }
 
-/* find index of v in vbuf; adds it if it doesn't already exist; returns -1 on failure */
-static int vbufGetVertexIndex(struct vertex *vbuf, int *vbufIndex, struct vertex v)
+/* rdp/rsp state a material sets, split into pieces that can change
+ * independently; each piece is identified by a key, and its value is
+ * every command setting it, in order
+ */
+struct matState
 {
-	if (!vbuf || !vbufIndex)
-		return -1;
+	int num;
+	bool opaque; /* sets something that can't be tracked */
+	uint32_t key[MATSTATE_MAX];
+	uint32_t hash[MATSTATE_MAX];
+};
+
+/* what part of the state a command sets; 0 = nothing worth keeping,
+ * UINT32_MAX = something that can't be tracked
+ */
+static uint32_t matStateKey(const uint8_t *cmd)
+{
+	switch (*cmd)
+	{
+		/* texture image, tile descriptors, and tmem all depend
+		 * on one another, so they change together
+		 */
+		case G_SETTIMG:
+		case G_SETTILE:
+		case G_SETTILESIZE:
+		case G_LOADBLOCK:
+		case G_LOADTILE:
+		case G_LOADTLUT:
+		case G_RDPLOADSYNC:
+		case G_RDPTILESYNC:
+			return G_SETTIMG << 24;
+		
+		/* one piece per opcode; G_GEOMETRYMODE and G_SETOTHERMODE_*
+		 * only clear/set or shift in some bits, but a piece is the
+		 * material's whole run of them, hashed and re-emitted as is,
+		 * so the result is the same as calling the full material
+		 */
+		case G_TEXTURE:
+		case G_GEOMETRYMODE:
+		case G_SETOTHERMODE_L:
+		case G_SETOTHERMODE_H:
+		case G_SETKEYGB:
+		case G_SETKEYR:
+		case G_SETCONVERT:
+		case G_SETSCISSOR:
+		case G_SETPRIMDEPTH:
+		case G_SETFILLCOLOR:
+		case G_SETFOGCOLOR:
+		case G_SETBLENDCOLOR:
+		case G_SETPRIMCOLOR:
+		case G_SETENVCOLOR:
+		case G_SETCOMBINE:
+			return *cmd << 24;
+		
+		/* one per index and offset */
+		case G_MOVEWORD:
+		case G_MOVEMEM:
+			return (*cmd << 24) | (cmd[1] << 16) | (cmd[2] << 8) | cmd[3];
+		
+		/* the delta starts with its own sync; and writeMaterials
+		 * drops nested display lists
+		 */
+		case G_RDPPIPESYNC:
+		case G_RDPFULLSYNC:
+		case G_CULLDL:
+		case G_DL:
+		case 0x00: /* G_NOOP */
+			return 0;
+	}
 	
-	/* return match if one already exists */
-	for (int i = 0; i < *vbufIndex; ++i)
-		if (!memcmp(vbuf + i, &v, sizeof(v)))
-			return i;
+	return UINT32_MAX;
+}
+
+/* splits a material's commands into pieces of state */
+static void matStateOf(struct matState *dst, const struct material *m)
+{
+	const uint8_t *data = m->data;
 	
-	/* too little space */
-	if (*vbufIndex >= VBUF_MAX)
-		return -1;
+	memset(dst, 0, sizeof(*dst));
 	
-	/* append */
-	vbuf[*vbufIndex] = v;
-	*vbufIndex += 1;
+	for (;;)
+	{
+		uint32_t key = 0;
+		uint32_t hash = 0x811c9dc5;
+		
+		/* gather every command of the next key not yet seen */
+		for (int at = 0; at + 8 <= m->dataLen; at += 8)
+		{
+			uint32_t k = matStateKey(data + at);
+			int seen = 0;
+			
+			if (!k)
+				continue;
+			if (k == UINT32_MAX)
+			{
+				dst->opaque = true;
+				return;
+			}
+			while (seen < dst->num && dst->key[seen] != k)
+				++seen;
+			if (seen < dst->num)
+				continue;
+			if (!key)
+				key = k;
+			if (k == key)
+				for (int b = 0; b < 8; ++b)
+					hash = (hash ^ data[at + b]) * 0x01000193;
+		}
+		
+		if (!key)
+			break;
+		if (dst->num >= MATSTATE_MAX)
+		{
+			dst->opaque = true;
+			return;
+		}
+		dst->key[dst->num] = key;
+		dst->hash[dst->num] = hash;
+		dst->num += 1;
+	}
+}
+
+/* index of key in state, or -1 */
+static int matStateFind(const struct matState *state, uint32_t key)
+{
+	for (int i = 0; i < state->num; ++i)
+		if (state->key[i] == key)
+			return i;
 	
-	return (*vbufIndex) - 1;
+	return -1;
 }
 
-static void group_merge(struct group *dst, struct group *src)
+/* switches from state to material m, which is called as a whole with
+ * G_DL unless inlining the commands that differ executes fewer of them;
+ * state becomes what the rdp holds afterward
+ */
+static void matStateSwitch(struct matState *state, bool *stateValid, struct material *m, struct buffer *dl, int stats[3])
 {
-	struct triangle *t;
+	const uint8_t *data = m->data;
+	struct matState next;
+	bool changed[MATSTATE_MAX] = {0};
+	int full = 2; /* G_DL and G_ENDDL */
+	int delta = 1; /* G_RDPPIPESYNC */
 	
-	if (!dst || !src)
-		return;
+	matStateOf(&next, m);
 	
-	if (src->child)
+	for (int at = 0; at + 8 <= m->dataLen; at += 8)
+		if (data[at] != G_CULLDL && data[at] != G_DL)
+			full += 1;
+	
+	if (*stateValid && !next.opaque)
 	{
-		struct group *dst = src;
-		struct group *next = 0;
+		for (int i = 0; i < next.num; ++i)
+		{
+			int k = matStateFind(state, next.key[i]);
+			
+			changed[i] = k < 0 || state->hash[k] != next.hash[i];
+		}
 		
-		for (struct group *src = dst->child; src; src = next)
+		for (int at = 0; at + 8 <= m->dataLen; at += 8)
 		{
-			next = src->next;
-			group_merge(dst, src);
+			int k = matStateFind(&next, matStateKey(data + at));
+			
+			if (k >= 0 && changed[k])
+				delta += 1;
 		}
 	}
+	else
+		delta = full;
 	
-	for (t = dst->tri; t && t->next; )
-		t = t->next;
+	/* nothing differs */
+	if (delta == 1)
+	{
+		stats[0] += 1;
+		return;
+	}
 	
-	t->next = src->tri;
-	free(src);
+	if (delta < full)
+	{
+		const uint8_t sync[8] = { G_RDPPIPESYNC };
+		
+		buffer_write(dl, sync, sizeof(sync));
+		for (int at = 0; at + 8 <= m->dataLen; at += 8)
+		{
+			int k = matStateFind(&next, matStateKey(data + at));
+			
+			if (k >= 0 && changed[k])
+				buffer_write(dl, data + at, 8);
+		}
+		stats[1] += 1;
+	}
+	else
+	{
+		uint32_t a = m->wroteAt;
+		uint8_t call[8] = { G_DL, 0, 0, 0, a >> 24, a >> 16, a >> 8, a };
+		
+		buffer_write(dl, call, sizeof(call));
+		stats[2] += 1;
+	}
+	
+	/* pieces the material doesn't set keep their old values */
+	if (next.opaque)
+	{
+		*stateValid = false;
+		state->num = 0;
+		return;
+	}
+	for (int i = 0; i < next.num; ++i)
+	{
+		int k = matStateFind(state, next.key[i]);
+		
+		if (k < 0 && state->num >= MATSTATE_MAX)
+		{
+			*stateValid = false;
+			state->num = 0;
+			return;
+		}
+		if (k < 0)
+		{
+			k = state->num++;
+			state->key[k] = next.key[i];
+		}
+		state->hash[k] = next.hash[i];
+	}
+	*stateValid = true;
 }
 
-static void group_bounds_recursive(const struct group *g, struct bbox *bbox)
+/* vertex buffer slots as seen by the rsp while compiling a display list */
+struct vbufCache
 {
-	struct triangle *t;
+	struct vertex v[VBUF_MAX];
+	uint32_t used[VBUF_MAX]; /* lru timestamp; 0 = slot is empty */
+	bool locked[VBUF_MAX]; /* referenced by triangles not yet flushed */
+	bool pending[VBUF_MAX]; /* assigned but not yet loaded by G_VTX */
+	uint32_t clock;
+	int loads; /* stats */
+	int cmds;
+};
+
+/* find slot holding v; if absent, claims an empty or least recently
+ * used slot not referenced by unflushed triangles; returns -1 if every
+ * slot is locked (caller must flush and retry)
+ */
+static int vbufCacheGet(struct vbufCache *c, struct vertex v)
+{
+	int victim = -1;
 	
-	if (!g || !bbox)
-		return;
+	/* return match if one already exists */
+	for (int i = 0; i < VBUF_MAX; ++i)
+	{
+		if (c->used[i] && !memcmp(c->v + i, &v, sizeof(v)))
+		{
+			c->used[i] = ++c->clock;
+			c->locked[i] = true;
+			return i;
+		}
+	}
 	
-	for (t = g->tri; t; t = t->next)
+	/* evict */
+	for (int i = 0; i < VBUF_MAX; ++i)
+		if (!c->locked[i] && (victim < 0 || c->used[i] < c->used[victim]))
+			victim = i;
+	
+	/* too little space */
+	if (victim < 0)
+		return -1;
+	
+	c->v[victim] = v;
+	c->used[victim] = ++c->clock;
+	c->locked[victim] = true;
+	c->pending[victim] = true;
+	
+	return victim;
+}
+
+/* writes vertices pending in the cache to vtx, loads them with G_VTX,
+ * then draws triangles [tBegin, tEnd) to dl; G_VTX addresses are
+ * relative to the start of vtx, and their offsets within dl are
+ * appended to reloc so they can be patched once vtx is placed
+ */
+static void vbufCacheFlush(struct vbufCache *c, struct buffer *vtx, struct buffer *reloc, struct buffer *dl, struct triangle *tBegin, struct triangle *tEnd)
+{
+	/* one G_VTX per contiguous run of pending slots */
+	for (int i = 0; i < VBUF_MAX; )
 	{
-#define DO_BOUNDS(V, X, FUNC) \
-	bbox->V = FUNC( \
-		bbox->V \
-		, t->v[0].X \
-		, t->v[1].X \
-		, t->v[2].X \
-	)
-		DO_BOUNDS(xmin, x, min4_int);
-		DO_BOUNDS(ymin, y, min4_int);
-		DO_BOUNDS(zmin, z, min4_int);
+		uint32_t addr = 0x03000000 | vtx->len;
+		int start = i;
 		
-		DO_BOUNDS(xmax, x, max4_int);
-		DO_BOUNDS(ymax, y, max4_int);
-		DO_BOUNDS(zmax, z, max4_int);
-#undef DO_BOUNDS
+		if (!c->pending[i])
+		{
+			++i;
+			continue;
+		}
+		
+		for ( ; i < VBUF_MAX && c->pending[i]; ++i)
+		{
+			struct vertex *v = c->v + i;
+			uint8_t result[16];
+			
+			memcpy(result, v, sizeof(*v));
+			BEw16(result + 0, v->x);
+			BEw16(result + 2, v->y);
+			BEw16(result + 4, v->z);
+			
+			buffer_write(vtx, result, sizeof(result));
+			c->pending[i] = false;
+		}
+		
+		{
+			int num = i - start;
+			uint8_t cmd[8] = {
+				G_VTX
+				, num >> 4
+				, num << 4
+				, ((start + num) & 0x7f) << 1
+				, addr >> 24, addr >> 16, addr >> 8, addr
+			};
+			
+			uint32_t at = dl->len;
+			
+			buffer_write(reloc, &at, sizeof(at));
+			buffer_write(dl, cmd, sizeof(cmd));
+			c->loads += num;
+			c->cmds += 1;
+		}
 	}
 	
-	if (g->child)
-		group_bounds_recursive(g->child, bbox);
+	/* triangles */
+	for (struct triangle *w = tBegin; w != tEnd && w; w = w->next)
+	{
+		struct triangle *n = w->next != tEnd ? w->next : 0;
+		uint8_t cmd[8] = {
+			G_TRI
+			, w->vbidx[0] << 1
+			, w->vbidx[1] << 1
+			, w->vbidx[2] << 1
+		};
+		
+		if (n)
+			cmd[0] = G_TRI2
+			, cmd[5] = n->vbidx[0] << 1
+			, cmd[6] = n->vbidx[1] << 1
+			, cmd[7] = n->vbidx[2] << 1
+			, w = n
+		;
+		
+		buffer_write(dl, cmd, sizeof(cmd));
+	}
+	
+	memset(c->locked, 0, sizeof(c->locked));
 }
 
-static struct bbox group_bounds(const struct group *g)
+/* state of a zroom file being written one group at a time */
+struct zroomWriter
 {
-	struct bbox result = BBOX_INIT_V;
+	struct buffer out; /* bytes not yet handed to fp */
+	size_t outBase; /* bytes already handed to fp */
+	FILE *fp; /* when 0, the whole file is kept in out */
+	FILE *yaz0Fp; /* where compressed output goes, once out is complete */
+	size_t meshHeaderPtr; /* where the room header points to the mesh header */
+	uint32_t *wroteAt; /* one mesh header entry per written group */
+	int opaNum;
+	int opaCap;
+	int triNum; /* stats */
+	int loads;
+	int cmds;
+	int sharedGroups;
+	int sharedRuns;
+	int sharedBatches;
+	size_t sharedBytes;
+	int matSwitches[3];
+	int clusters;
+	size_t padding;
+	bool withMaterials;
+	bool failed; /* fp refused some of the output */
+	struct room_writeOptions opt;
+	struct zroomShared **shared; /* content already written, by hash */
+};
+
+/* a group compiled on its own, awaiting placement in the file */
+struct zroomGroup
+{
+	struct group *g;
+	struct buffer vtx;
+	struct buffer dl;
+	struct buffer reloc; /* uint32_t offsets of G_VTX commands in dl */
+	struct buffer sub; /* cluster display lists, each called from dl */
+	struct buffer subReloc; /* uint32_t offsets of G_VTX commands in sub */
+	struct buffer clusterAt; /* uint32_t offset of each cluster in sub */
+	int triNum; /* stats */
+	int loads;
+	int cmds;
+	int matSwitches[3]; /* skipped, inlined as deltas, called */
+	int clusters;
+};
+
+/* content written once, and referenced wherever it repeats */
+#define ZROOM_SHARED_BUCKETS 4096
+enum zroomSharedKind
+{
+	ZROOM_SHARED_GROUP = 0 /* a whole compiled group */
+	, ZROOM_SHARED_RUN /* vertices loaded by one G_VTX */
+	, ZROOM_SHARED_BATCH /* triangles between G_VTX, as a display list */
+};
+struct zroomShared
+{
+	struct zroomShared *next;
+	uint32_t hash;
+	uint32_t addr; /* or, while counting, occurrences */
+	int kind;
+	size_t len;
+	uint8_t data[];
+};
+
+/* groups shared by compile threads */
+struct zroomJobs
+{
+	struct zroomGroup *group;
+	int groupNum;
+	int next;
+	bool withMaterials;
+	const struct room_writeOptions *opt;
+	bool threaded;
+	pthread_mutex_t lock;
+};
+
+static uint32_t zroomSharedHash(int kind, const void *data, size_t len)
+{
+	return fnv1a32(data, len) ^ (kind * 0x9e3779b9u);
+}
+
+static struct zroomShared *zroomSharedFind(struct zroomShared **map, int kind, const void *data, size_t len)
+{
+	uint32_t hash = zroomSharedHash(kind, data, len);
 	
-	if (!g)
-		return result;
+	if (!map)
+		return 0;
 	
-	group_bounds_recursive(g, &result);
+	for (struct zroomShared *s = map[hash % ZROOM_SHARED_BUCKETS]; s; s = s->next)
+		if (s->hash == hash && s->kind == kind && s->len == len && !memcmp(s->data, data, len))
+			return s;
 	
-	return result;
+	return 0;
 }
 
-static bool triangle_inside_bbox(const struct triangle t, const struct bbox bb)
+static struct zroomShared *zroomSharedAdd(struct zroomShared **map, int kind, const void *data, size_t len, uint32_t addr)
 {
-	/* use center point */
-	struct vertex v;
+	struct zroomShared *s = malloc(sizeof(*s) + len);
+	struct zroomShared **bucket;
 	
-	v.x = (t.v[0].x + t.v[1].x + t.v[2].x) / 3;
-	v.y = (t.v[0].y + t.v[1].y + t.v[2].y) / 3;
-	v.z = (t.v[0].z + t.v[1].z + t.v[2].z) / 3;
+	s->hash = zroomSharedHash(kind, data, len);
+	s->addr = addr;
+	s->kind = kind;
+	s->len = len;
+	memcpy(s->data, data, len);
 	
-	return v.x >= bb.xmin
-		&& v.x <= bb.xmax
-		&& v.y >= bb.ymin
-		&& v.y <= bb.ymax
-		&& v.z >= bb.zmin
-		&& v.z <= bb.zmax
-	;
+	bucket = &map[s->hash % ZROOM_SHARED_BUCKETS];
+	s->next = *bucket;
+	*bucket = s;
+	
+	return s;
 }
 
-static void group_divide(struct group *g, struct bbox *bbox, const int divisions[], const int divisionsNum)
+static void zroomSharedFree(struct zroomShared **map)
 {
-	if (!divisionsNum)
+	if (!map)
 		return;
 	
-	int largest = max4_int(0, bbox->xmax - bbox->xmin, bbox->ymax - bbox->ymin, bbox->zmax - bbox->zmin);
-	int div = divisions[0];
-	int tmp = 0;
-	int sec;
-	
-	/* ensure that the largest is evenly divisible by the number of divisions */
-	while (largest % div)
-		++largest;
-	sec = largest / div;
-	
-	/* if bbox isn't a cube, make it a cube */
-	//int delta;
-	//if ((delta = (largest - (bbox->xmax - bbox->xmin))) != 0) // XXX old idea
-	//	bbox->xmax += delta / 2, bbox->xmin -= delta / 2;
-#define DO_ONE(VMIN, VMAX) \
-	while ((bbox->VMAX - bbox->VMIN) != largest) \
+	for (int i = 0; i < ZROOM_SHARED_BUCKETS; ++i)
+	{
+		for (struct zroomShared *s = map[i], *next; s; s = next)
+		{
+			next = s->next;
+			free(s);
+		}
+	}
+	free(map);
+}
+
+/* end of the run of triangle commands starting at dl[at] */
+static size_t zroomBatchEnd(const struct buffer *dl, size_t at)
+{
+	while (at < dl->len && (dl->data[at] == G_TRI || dl->data[at] == G_TRI2))
+		at += 8;
+	
+	return at;
+}
+
+/* counts each triangle batch of a compiled display list */
+static void zroomCountBatches(struct zroomShared **count, const struct buffer *dl)
+{
+	for (size_t at = 0; at < dl->len; )
+	{
+		size_t end = zroomBatchEnd(dl, at);
+		struct zroomShared *s;
+		
+		if (end - at < 16)
+		{
+			at = end > at ? end : at + 8;
+			continue;
+		}
+		
+		if ((s = zroomSharedFind(count, ZROOM_SHARED_BATCH, dl->data + at, end - at)))
+			s->addr += 1;
+		else
+			zroomSharedAdd(count, ZROOM_SHARED_BATCH, dl->data + at, end - at, 1);
+		at = end;
+	}
+}
+
+/* current write position as a segment address */
+static uint32_t zroomAddr(const struct zroomWriter *w)
+{
+	return 0x03000000 | (w->outBase + w->out.len);
+}
+
+/* hands everything written so far to fp, if there is one;
+ * a failed write is remembered, and reported by zroomEnd
+ */
+static void zroomDrain(struct zroomWriter *w)
+{
+	if (!w->fp || !w->out.len)
+		return;
+	
+	if (!w->failed && fwrite(w->out.data, 1, w->out.len, w->fp) != w->out.len)
+		w->failed = true;
+	
+	w->outBase += w->out.len;
+	w->out.len = 0;
+}
+
+/* write placeholder room header, and materials if requested;
+ * output goes to fp if provided, otherwise it is kept in memory
+ */
+static void zroomBegin(struct zroomWriter *w, struct room *room, FILE *fp, bool withMaterials, const struct room_writeOptions *opt)
+{
+	unsigned char roomHeader[] = {
+		0x16, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x08, 0x00, 0x00, 0x00,	0x00, 0x00, 0x00, 0x00,
+		0x12, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x10, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0x0A, 0x00,
+		0x0A, 0x00, 0x00, 0x00,	0x03, 0x00, 0x00, 0x00,
+		0x05, 0x00, 0x00, 0x00, 0x0F, 0x28, 0x6D, 0xBE,
+		0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00,	0x00, 0x00, 0x00, 0x00
+	};
+	
+	w->fp = fp;
+	w->withMaterials = withMaterials;
+	w->opt = opt ? *opt : sgWriteDefaults;
+	
+	/* compressing needs the whole file */
+	if (w->opt.yaz0 && fp)
+	{
+		w->yaz0Fp = fp;
+		w->fp = 0;
+	}
+	
+	/* locate the mesh header command */
+	while (roomHeader[w->meshHeaderPtr] != 0x0A)
+		w->meshHeaderPtr += 8;
+	w->meshHeaderPtr += 4;
+	
+	/* write placeholder room header */
+	buffer_write(&w->out, roomHeader, sizeof(roomHeader));
+	
+	/* write every material */
+	if (withMaterials)
+		writeMaterials(room, &w->out, w->outBase, w->opt.layout, &w->padding);
+}
+
+static void zroomGroupFree(struct zroomGroup *c)
+{
+	buffer_free(&c->vtx);
+	buffer_free(&c->dl);
+	buffer_free(&c->reloc);
+	buffer_free(&c->sub);
+	buffer_free(&c->subReloc);
+	buffer_free(&c->clusterAt);
+}
+
+/* something and where it lies along a z-order curve; index breaks
+ * ties, so the order is the same from run to run
+ */
+struct zOrder
+{
+	uint32_t code;
+	int index;
+	void *item;
+};
+
+static int zOrder_compare(const void *a, const void *b)
+{
+	const struct zOrder *x = a;
+	const struct zOrder *y = b;
+	
+	if (x->code != y->code)
+		return (x->code > y->code) - (x->code < y->code);
+	
+	return x->index - y->index;
+}
+
+/* spreads the low 10 bits of v out to every third bit */
+static uint32_t zOrderSpread(uint32_t v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	
+	return v;
+}
+
+/* writes one cluster of triangles [begin, end) as its own display
+ * list in sub: its bounding box is loaded and tested with G_CULLDL,
+ * so the rsp skips the rest when the box is out of view
+ */
+static void zroomWriteCluster(struct zroomGroup *c, struct zOrder *begin, struct zOrder *end)
+{
+	const uint8_t enddl[8] = { G_ENDDL };
+	const uint8_t culldl[8] = { G_CULLDL, 0, 0, 0, 0, 0, 0, 7 << 1 };
+	struct vbufCache vbuf = {0};
+	struct triangle *copy = calloc(end - begin, sizeof(*copy));
+	struct bbox b = BBOX_INIT_V;
+	uint32_t at = c->sub.len;
+	uint32_t addr = 0x03000000 | c->vtx.len;
+	uint8_t load[8] = { G_VTX, 0, 8 << 4, 8 << 1, U32_BYTES(addr) };
+	
+	/* copies are linked in cluster order, leaving the group intact */
+	for (struct zOrder *t = begin; t < end; ++t)
+	{
+		struct triangle *dst = &copy[t - begin];
+		
+		*dst = *(struct triangle*)t->item;
+		dst->next = t + 1 < end ? dst + 1 : 0;
+		for (int i = 0; i < 3; ++i)
+		{
+			dst->vbidx[i] = vbufCacheGet(&vbuf, dst->v[i]);
+			b.xmin = min_int(b.xmin, dst->v[i].x);
+			b.ymin = min_int(b.ymin, dst->v[i].y);
+			b.zmin = min_int(b.zmin, dst->v[i].z);
+			b.xmax = max_int(b.xmax, dst->v[i].x);
+			b.ymax = max_int(b.ymax, dst->v[i].y);
+			b.zmax = max_int(b.zmax, dst->v[i].z);
+		}
+	}
+	
+	/* bounding box corners */
+	for (int i = 0; i < 8; ++i)
+	{
+		uint8_t corner[16] = {0};
+		
+		BEw16(corner + 0, (i & 1) ? b.xmax : b.xmin);
+		BEw16(corner + 2, (i & 2) ? b.ymax : b.ymin);
+		BEw16(corner + 4, (i & 4) ? b.zmax : b.zmin);
+		buffer_write(&c->vtx, corner, sizeof(corner));
+	}
+	buffer_write(&c->clusterAt, &at, sizeof(at));
+	buffer_write(&c->subReloc, &c->sub.len, sizeof(uint32_t));
+	buffer_write(&c->sub, load, sizeof(load));
+	buffer_write(&c->sub, culldl, sizeof(culldl));
+	
+	vbufCacheFlush(&vbuf, &c->vtx, &c->subReloc, &c->sub, copy, 0);
+	buffer_write(&c->sub, enddl, sizeof(enddl));
+	
+	c->loads += vbuf.loads + 8;
+	c->cmds += vbuf.cmds + 1;
+	c->clusters += 1;
+	free(copy);
+}
+
+/* splits triangles [begin, end), which share a material, into clusters
+ * that each fit the vertex buffer; triangles are taken in z-order, so
+ * each cluster stays compact and its bounding box tight
+ */
+static void zroomCompileClusters(struct zroomGroup *c, struct triangle *begin, struct triangle *end)
+{
+	struct zOrder *tri;
+	struct bbox b = BBOX_INIT_V;
+	struct vertex seen[VBUF_MAX];
+	int seenNum = 0;
+	int num = 0;
+	int first = 0;
+	
+	for (struct triangle *t = begin; t != end; t = t->next)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			b.xmin = min_int(b.xmin, t->v[i].x);
+			b.ymin = min_int(b.ymin, t->v[i].y);
+			b.zmin = min_int(b.zmin, t->v[i].z);
+			b.xmax = max_int(b.xmax, t->v[i].x);
+			b.ymax = max_int(b.ymax, t->v[i].y);
+			b.zmax = max_int(b.zmax, t->v[i].z);
+		}
+		++num;
+	}
+	
+	tri = malloc(num * sizeof(*tri));
+	num = 0;
+	for (struct triangle *t = begin; t != end; t = t->next, ++num)
+	{
+		/* centroid, scaled to 10 bits per axis */
+		int x = (t->v[0].x + t->v[1].x + t->v[2].x) / 3 - b.xmin;
+		int y = (t->v[0].y + t->v[1].y + t->v[2].y) / 3 - b.ymin;
+		int z = (t->v[0].z + t->v[1].z + t->v[2].z) / 3 - b.zmin;
+		
+		x = (int64_t)x * 1023 / max_int(1, b.xmax - b.xmin);
+		y = (int64_t)y * 1023 / max_int(1, b.ymax - b.ymin);
+		z = (int64_t)z * 1023 / max_int(1, b.zmax - b.zmin);
+		tri[num].code = zOrderSpread(x) | (zOrderSpread(y) << 1) | (zOrderSpread(z) << 2);
+		tri[num].index = num;
+		tri[num].item = t;
+	}
+	qsort(tri, num, sizeof(*tri), zOrder_compare);
+	
+	/* fill each cluster until its vertices would overflow the buffer */
+	for (int i = 0; i < num; ++i)
+	{
+		struct vertex fresh[3];
+		int freshNum = 0;
+		
+		for (int k = 0; k < 3; ++k)
+		{
+			const struct vertex *v = &((struct triangle*)tri[i].item)->v[k];
+			bool known = false;
+			
+			for (int n = 0; !known && n < seenNum; ++n)
+				known = !memcmp(&seen[n], v, sizeof(*v));
+			for (int n = 0; !known && n < freshNum; ++n)
+				known = !memcmp(&fresh[n], v, sizeof(*v));
+			if (!known)
+				fresh[freshNum++] = *v;
+		}
+		
+		if (seenNum + freshNum > VBUF_MAX)
+		{
+			zroomWriteCluster(c, tri + first, tri + i);
+			first = i;
+			seenNum = 0;
+			i -= 1; /* retry against an empty cluster */
+			continue;
+		}
+		
+		memcpy(seen + seenNum, fresh, freshNum * sizeof(*fresh));
+		seenNum += freshNum;
+	}
+	if (first < num)
+		zroomWriteCluster(c, tri + first, tri + num);
+	
+	free(tri);
+}
+
+/* emits a switch to material mat */
+static void zroomSwitchMaterial(struct zroomGroup *c, const struct room_writeOptions *opt, struct matState *state, bool *stateValid, struct material *mat)
+{
+	uint32_t a = mat->wroteAt;
+	uint8_t branch[8] = { G_DL, 0, 0, 0, a >> 24, a >> 16, a >> 8, a };
+	
+	if (opt->materialDeltas)
+		matStateSwitch(state, stateValid, mat, &c->dl, c->matSwitches);
+	else
+		buffer_write(&c->dl, branch, sizeof(branch));
+}
+
+/* compile a group's vertices and display list into its own buffers;
+ * touches nothing shared, so groups can compile in parallel
+ */
+static void zroomCompileGroup(struct zroomGroup *c, bool withMaterials, const struct room_writeOptions *opt)
+{
+	const uint8_t enddl[8] = { G_ENDDL };
+	struct triangle *tBegin = c->g->tri;
+	struct material *mat = 0;
+	struct vbufCache vbuf = {0};
+	struct matState state = {0}; /* unknown at the start of each group */
+	bool stateValid = false;
+	double traceStart = trace_now();
+	
+	/* clusters, each called from dl, between material switches */
+	if (opt->clusters)
+	{
+		for (struct triangle *t = tBegin; t; )
+		{
+			struct triangle *next = t->next;
+			int num = 1;
+			int first;
+			
+			while (next && (!withMaterials || next->mat == t->mat))
+				next = next->next, ++num;
+			
+			if (withMaterials && t->mat != mat)
+				zroomSwitchMaterial(c, opt, &state, &stateValid, (mat = t->mat));
+			
+			first = c->clusters;
+			zroomCompileClusters(c, t, next);
+			for (int i = first; i < c->clusters; ++i)
+			{
+				uint32_t at = ((uint32_t*)c->clusterAt.data)[i];
+				uint8_t call[8] = { G_DL, 0, 0, 0, U32_BYTES(at) };
+				
+				buffer_write(&c->dl, call, sizeof(call));
+			}
+			
+			c->triNum += num;
+			t = next;
+		}
+		buffer_write(&c->dl, enddl, sizeof(enddl));
+		goto done;
+	}
+	
+	/* triangle data first */
+	for (struct triangle *t = tBegin; t; t = t->next, ++c->triNum)
+	{
+		if (withMaterials && t->mat != mat)
+		{
+			vbufCacheFlush(&vbuf, &c->vtx, &c->reloc, &c->dl, tBegin, t);
+			tBegin = t;
+			mat = t->mat;
+			
+			zroomSwitchMaterial(c, opt, &state, &stateValid, mat);
+		}
+		
+		/* on running out of unlocked slots, flush and retry */
+		for (int i = 0; i < 3; )
+		{
+			if ((t->vbidx[i] = vbufCacheGet(&vbuf, t->v[i])) >= 0)
+			{
+				++i;
+				continue;
+			}
+			
+			vbufCacheFlush(&vbuf, &c->vtx, &c->reloc, &c->dl, tBegin, t);
+			tBegin = t;
+			i = 0;
+		}
+	}
+	
+	/* flush any remaining triangles */
+	vbufCacheFlush(&vbuf, &c->vtx, &c->reloc, &c->dl, tBegin, 0);
+	buffer_write(&c->dl, enddl, sizeof(enddl));
+	
+	c->loads = vbuf.loads;
+	c->cmds = vbuf.cmds;
+	
+done:
+	if (trace_on())
+	{
+		char detail[32];
+		
+		snprintf(detail, sizeof(detail), "%d triangles", c->triNum);
+		trace_span("compile group", traceStart, detail);
+	}
+}
+
+static void *zroomCompileWorker(void *arg)
+{
+	struct zroomJobs *jobs = arg;
+	
+	if (jobs->threaded)
+		trace_threadName("compile worker");
+	
+	for (;;)
+	{
+		int i;
+		
+		pthread_mutex_lock(&jobs->lock);
+		i = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+		
+		if (i >= jobs->groupNum)
+			break;
+		
+		zroomCompileGroup(&jobs->group[i], jobs->withMaterials, jobs->opt);
+	}
+	
+	return 0;
+}
+
+/* a group being placed in the file by zroomLinkGroup */
+struct zroomLink
+{
+	struct zroomWriter *w;
+	struct zroomShared **batchCount;
+	const struct buffer *src; /* the group's vertices */
+	struct buffer vtx; /* runs not written before */
+	struct buffer batch; /* shared batches not written before */
+	uint32_t base;
+};
+
+/* places the vertex run of each G_VTX that reloc lists in dl, or finds
+ * it already written, and points the command at it
+ */
+static void zroomLinkRuns(struct zroomLink *l, struct buffer *dl, const struct buffer *reloc)
+{
+	struct zroomWriter *w = l->w;
+	const uint32_t *relocAt = (const uint32_t*)reloc->data;
+	
+	for (size_t i = 0; i < reloc->len / sizeof(*relocAt); ++i)
+	{
+		uint8_t *cmd = dl->data + relocAt[i];
+		const uint8_t *src;
+		struct zroomShared *same;
+		uint32_t addr;
+		size_t len;
+		
+		src = l->src->data + (BEr32(cmd + 4) & 0x00ffffff);
+		len = ((cmd[1] << 4) | (cmd[2] >> 4)) * 16;
+		if ((same = zroomSharedFind(w->shared, ZROOM_SHARED_RUN, src, len)))
+		{
+			addr = same->addr;
+			w->sharedRuns += 1;
+			w->sharedBytes += len;
+		}
+		else
+		{
+			addr = l->base + l->vtx.len;
+			zroomSharedAdd(w->shared, ZROOM_SHARED_RUN, src, len, addr);
+			buffer_write(&l->vtx, src, len);
+		}
+		memcpy(cmd + 4, (uint8_t[]){ U32_BYTES(addr) }, 4);
+	}
+}
+
+/* appends display list [src, src + len) to dst, calling out to shared
+ * triangle batches; zroomLinkRuns has already placed its vertices
+ */
+static void zroomLinkDL(struct zroomLink *l, const uint8_t *src, size_t len, struct buffer *dst)
+{
+	struct zroomWriter *w = l->w;
+	const struct buffer dl = { .data = (uint8_t*)src, .len = len };
+	
+	for (size_t at = 0; at < dl.len; )
+	{
+		const uint8_t *cmd = dl.data + at;
+		size_t end = zroomBatchEnd(&dl, at);
+		int n = (end - at) / 8;
+		struct zroomShared *same;
+		
+		if (n >= 2)
+		{
+			const uint8_t enddl[8] = { G_ENDDL };
+			struct zroomShared *count = zroomSharedFind(l->batchCount, ZROOM_SHARED_BATCH, cmd, end - at);
+			int k = count ? count->addr : 1;
+			
+			/* a call and a terminator cost two commands */
+			if ((same = zroomSharedFind(w->shared, ZROOM_SHARED_BATCH, cmd, end - at)))
+			{
+				w->sharedBatches += 1;
+				w->sharedBytes += end - at - 8;
+			}
+			else if ((k - 1) * n > k + 1)
+			{
+				if (w->opt.layout)
+					padToLine(&l->batch, 0, &w->padding);
+				same = zroomSharedAdd(w->shared, ZROOM_SHARED_BATCH, cmd, end - at
+					, l->base + l->vtx.len + l->batch.len
+				);
+				buffer_write(&l->batch, cmd, end - at);
+				buffer_write(&l->batch, enddl, sizeof(enddl));
+			}
+			
+			if (same)
+			{
+				uint8_t call[8] = { G_DL, 0, 0, 0, U32_BYTES(same->addr) };
+				
+				buffer_write(dst, call, sizeof(call));
+				at = end;
+				continue;
+			}
+		}
+		
+		if (end == at)
+			end += 8;
+		buffer_write(dst, cmd, end - at);
+		at = end;
+	}
+}
+
+/* places a compiled group's vertices followed by its display list,
+ * patches its G_VTX addresses, and adds it to the mesh header;
+ * anything already written (the whole group, a vertex run, or a
+ * triangle batch that batchCount says repeats) is referenced instead
+ */
+static void zroomLinkGroup(struct zroomWriter *w, struct zroomGroup *c, struct zroomShared **batchCount)
+{
+	struct buffer key = {0};
+	struct buffer sub = {0};
+	struct buffer dl = {0};
+	struct zroomLink l = { .w = w, .batchCount = batchCount, .src = &c->vtx };
+	const uint32_t *clusterAt = (const uint32_t*)c->clusterAt.data;
+	uint32_t *clusterTo = malloc(c->clusterAt.len + 1);
+	int clusterNum = c->clusterAt.len / sizeof(*clusterAt);
+	struct zroomShared *same;
+	struct group *g = c->g;
+	
+	Log("processing group %p...", (void*)g);
+	
+	if (!w->shared)
+		w->shared = calloc(ZROOM_SHARED_BUCKETS, sizeof(*w->shared));
+	
+	w->triNum += c->triNum;
+	w->loads += c->loads;
+	w->cmds += c->cmds;
+	w->clusters += c->clusters;
+	for (int i = 0; i < 3; ++i)
+		w->matSwitches[i] += c->matSwitches[i];
+	
+	/* identical to a group already written */
+	buffer_write(&key, c->vtx.data, c->vtx.len);
+	buffer_write(&key, c->sub.data, c->sub.len);
+	buffer_write(&key, c->dl.data, c->dl.len);
+	if ((same = zroomSharedFind(w->shared, ZROOM_SHARED_GROUP, key.data, key.len)))
+	{
+		g->wroteAt = same->addr;
+		Log(" > same as %08x", g->wroteAt);
+		w->sharedGroups += 1;
+		w->sharedBytes += key.len;
+		goto done;
+	}
+	
+	/* vertex runs come first, so their addresses are known up front;
+	 * with layout, runs and each display list start on a cache line
+	 */
+	if (w->opt.layout)
+		padToLine(&w->out, w->outBase, &w->padding);
+	l.base = zroomAddr(w);
+	zroomLinkRuns(&l, &c->sub, &c->subReloc);
+	zroomLinkRuns(&l, &c->dl, &c->reloc);
+	
+	/* then the clusters and the display list, calling out to shared
+	 * batches; calls to clusters hold offsets within sub until the
+	 * batches are all placed
+	 */
+	for (int i = 0; i < clusterNum; ++i)
+	{
+		uint32_t end = i + 1 < clusterNum ? clusterAt[i + 1] : c->sub.len;
+		
+		if (w->opt.layout)
+			padToLine(&sub, 0, &w->padding);
+		clusterTo[i] = sub.len;
+		zroomLinkDL(&l, c->sub.data + clusterAt[i], end - clusterAt[i], &sub);
+	}
+	zroomLinkDL(&l, c->dl.data, c->dl.len, &dl);
+	if (w->opt.layout)
+	{
+		padToLine(&l.batch, 0, &w->padding);
+		padToLine(&sub, 0, &w->padding);
+	}
+	for (size_t at = 0, i = 0; at < dl.len; at += 8)
+	{
+		uint8_t *cmd = dl.data + at;
+		uint32_t addr;
+		
+		if (*cmd != G_DL || cmd[4] || i >= (size_t)clusterNum)
+			continue;
+		
+		addr = l.base + l.vtx.len + l.batch.len + clusterTo[i++];
+		memcpy(cmd + 4, (uint8_t[]){ U32_BYTES(addr) }, 4);
+	}
+	
+	buffer_write(&w->out, l.vtx.data, l.vtx.len);
+	buffer_write(&w->out, l.batch.data, l.batch.len);
+	buffer_write(&w->out, sub.data, sub.len);
+	g->wroteAt = zroomAddr(w);
+	Log(" > writing it at %08x", g->wroteAt);
+	buffer_write(&w->out, dl.data, dl.len);
+	zroomSharedAdd(w->shared, ZROOM_SHARED_GROUP, key.data, key.len, g->wroteAt);
+	
+done:
+	/* remember it for the mesh header */
+	if (w->opaNum >= w->opaCap)
+	{
+		w->opaCap = w->opaCap ? w->opaCap * 2 : 64;
+		w->wroteAt = realloc(w->wroteAt, w->opaCap * sizeof(*w->wroteAt));
+	}
+	w->wroteAt[w->opaNum++] = g->wroteAt;
+	
+	buffer_free(&key);
+	buffer_free(&l.vtx);
+	buffer_free(&l.batch);
+	buffer_free(&sub);
+	buffer_free(&dl);
+	free(clusterTo);
+	
+	zroomDrain(w);
+}
+
+/* gathers every group containing triangles, depth first */
+static void zroomGatherTree(struct buffer *dst, struct group *g)
+{
+	for ( ; g; g = g->next)
+	{
+		if (g->tri)
+		{
+			struct zroomGroup c = { .g = g };
+			
+			buffer_write(dst, &c, sizeof(c));
+		}
+		
+		if (g->child)
+			zroomGatherTree(dst, g->child);
+	}
+}
+
+/* compiles every group containing triangles across threads; returns
+ * them in depth-first order, and the caller frees each one's buffers
+ */
+static struct zroomGroup *zroomCompileTree(struct group *g, bool withMaterials, const struct room_writeOptions *opt, int *groupNum)
+{
+	struct buffer list = {0};
+	struct zroomJobs jobs = { .withMaterials = withMaterials, .opt = opt };
+	pthread_t thread[64];
+	int threadNum = opt->threads ? opt->threads : sgThreads;
+	
+	zroomGatherTree(&list, g);
+	jobs.group = (struct zroomGroup*)list.data;
+	jobs.groupNum = list.len / sizeof(*jobs.group);
+	
+	if (threadNum <= 0)
+		threadNum = sysconf(_SC_NPROCESSORS_ONLN);
+	threadNum = min_int(threadNum, sizeof(thread) / sizeof(*thread));
+	threadNum = min_int(threadNum, jobs.groupNum);
+	
+	/* compile */
+	if (threadNum <= 1)
+		zroomCompileWorker(&jobs);
+	else
+	{
+		pthread_mutex_init(&jobs.lock, 0);
+		jobs.threaded = true;
+		/* make do with the threads that could be created */
+		for (int i = 0; i < threadNum; ++i)
+			if (pthread_create(&thread[i], 0, zroomCompileWorker, &jobs))
+				threadNum = i;
+		if (!threadNum)
+		{
+			jobs.threaded = false;
+			zroomCompileWorker(&jobs);
+		}
+		for (int i = 0; i < threadNum; ++i)
+			pthread_join(thread[i], 0);
+		pthread_mutex_destroy(&jobs.lock);
+	}
+	
+	*groupNum = jobs.groupNum;
+	
+	return jobs.group;
+}
+
+/* sorts compiled groups along a z-order curve through their centers,
+ * so groups near one another in the room are near one another in the file
+ */
+static void zroomSpatialOrder(struct zroomGroup *group, int groupNum)
+{
+	struct zOrder *order = malloc(groupNum * sizeof(*order));
+	struct zroomGroup *sorted = malloc(groupNum * sizeof(*sorted));
+	struct bbox all = BBOX_INIT_V;
+	struct bbox *b = malloc(groupNum * sizeof(*b));
+	
+	for (int i = 0; i < groupNum; ++i)
+	{
+		b[i] = BBOX_INIT_V;
+		for (const struct triangle *t = group[i].g->tri; t; t = t->next)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				b[i].xmin = min_int(b[i].xmin, t->v[k].x);
+				b[i].ymin = min_int(b[i].ymin, t->v[k].y);
+				b[i].zmin = min_int(b[i].zmin, t->v[k].z);
+				b[i].xmax = max_int(b[i].xmax, t->v[k].x);
+				b[i].ymax = max_int(b[i].ymax, t->v[k].y);
+				b[i].zmax = max_int(b[i].zmax, t->v[k].z);
+			}
+		}
+		all.xmin = min_int(all.xmin, b[i].xmin);
+		all.ymin = min_int(all.ymin, b[i].ymin);
+		all.zmin = min_int(all.zmin, b[i].zmin);
+		all.xmax = max_int(all.xmax, b[i].xmax);
+		all.ymax = max_int(all.ymax, b[i].ymax);
+		all.zmax = max_int(all.zmax, b[i].zmax);
+	}
+	
+	for (int i = 0; i < groupNum; ++i)
+	{
+		/* center, scaled to 10 bits per axis */
+		int x = ((b[i].xmin + b[i].xmax) / 2 - all.xmin) * 1023LL / max_int(1, all.xmax - all.xmin);
+		int y = ((b[i].ymin + b[i].ymax) / 2 - all.ymin) * 1023LL / max_int(1, all.ymax - all.ymin);
+		int z = ((b[i].zmin + b[i].zmax) / 2 - all.zmin) * 1023LL / max_int(1, all.zmax - all.zmin);
+		
+		order[i].code = zOrderSpread(x) | (zOrderSpread(y) << 1) | (zOrderSpread(z) << 2);
+		order[i].index = i;
+		order[i].item = &group[i];
+	}
+	qsort(order, groupNum, sizeof(*order), zOrder_compare);
+	
+	for (int i = 0; i < groupNum; ++i)
+		sorted[i] = *(struct zroomGroup*)order[i].item;
+	memcpy(group, sorted, groupNum * sizeof(*group));
+	
+	free(order);
+	free(sorted);
+	free(b);
+}
+
+/* write every group containing triangles: compile them across threads,
+ * then link them in depth-first order (or, with layout, z-order)
+ */
+static void zroomWriteTree(struct zroomWriter *w, struct group *g)
+{
+	int groupNum;
+	struct zroomGroup *group = zroomCompileTree(g, w->withMaterials, &w->opt, &groupNum);
+	struct zroomShared **batchCount = calloc(ZROOM_SHARED_BUCKETS, sizeof(*batchCount));
+	double traceStart = trace_now();
+	
+	if (w->opt.layout && groupNum > 1)
+		zroomSpatialOrder(group, groupNum);
+	
+	/* how often each triangle batch occurs decides which get shared */
+	for (int i = 0; i < groupNum; ++i)
+	{
+		zroomCountBatches(batchCount, &group[i].dl);
+		zroomCountBatches(batchCount, &group[i].sub);
+	}
+	
+	for (int i = 0; i < groupNum; ++i)
+	{
+		struct zroomGroup *c = &group[i];
+		
+		zroomLinkGroup(w, c, batchCount);
+		zroomGroupFree(c);
+	}
+	trace_span("link", traceStart, 0);
+	
+	zroomSharedFree(batchCount);
+	free(group);
+}
+
+/* write mesh header and point the room header to it; when writing to
+ * fp, the file is closed, otherwise the result remains in w->out
+ */
+static void zroomEnd(struct zroomWriter *w)
+{
+	uint32_t wroteAt;
+	
+	if (w->opt.layout)
+		padToLine(&w->out, w->outBase, &w->padding);
+	wroteAt = zroomAddr(w);
+	
+	Log("wrote %d triangles; loaded %d vertices (%d bytes) with %d G_VTX"
+		, w->triNum, w->loads, w->loads * 16, w->cmds
+	);
+	if (w->sharedBytes)
+		Log("instanced %d groups, %d vertex runs and %d triangle batches, saving %zu bytes"
+			, w->sharedGroups, w->sharedRuns, w->sharedBatches, w->sharedBytes
+		);
+	if (w->clusters)
+		Log("split groups into %d clusters", w->clusters);
+	if (w->opt.materialDeltas && w->withMaterials)
+		Log("material switches: %d called, %d inlined as deltas, %d skipped as unchanged"
+			, w->matSwitches[2], w->matSwitches[1], w->matSwitches[0]
+		);
+	zroomSharedFree(w->shared);
+	w->shared = 0;
+	
+	if (w->opaNum > UINT8_MAX)
+		die("room has %d groups, but a mesh header holds at most %d"
+			, w->opaNum, UINT8_MAX
+		);
+	
+	/* write mesh header */
+	{
+		const int type = 0x00;
+		const int stride = (type == 0x00) ? 8 : 16;
+		uint32_t start = wroteAt + 12;
+		uint32_t end = start + w->opaNum * stride;
+		uint8_t meshHeader[] = {
+			type // type
+			, w->opaNum // number of entries
+			, 0 // padding
+			, 0 // padding
+			, U32_BYTES(start)
+			, U32_BYTES(end)
+		};
+		
+		/* main header structure */
+		buffer_write(&w->out, meshHeader, sizeof(meshHeader));
+		
+		/* the mesh pointer array referenced by the header */
+		for (int i = 0; i < w->opaNum; ++i)
+		{
+			if (type == 0x00)
+			{
+				uint8_t tmp[8] = { U32_BYTES(w->wroteAt[i]) }; // opa, xlu
+				
+				buffer_write(&w->out, tmp, sizeof(tmp));
+			}
+			else if (type == 0x02)
+			{
+				// TODO
+			}
+		}
+		
+		/* 16-byte alignment */
+		while ((w->outBase + w->out.len) & 0xf)
+			buffer_write(&w->out, "", 1);
+	}
+	
+	if (w->opt.layout)
+		Log("layout: %zu bytes of padding, %.2f%% of %zu"
+			, w->padding
+			, 100.0 * w->padding / (w->outBase + w->out.len)
+			, w->outBase + w->out.len
+		);
+	
+	/* update room header to point to mesh header */
+	{
+		uint8_t tmp[4] = { U32_BYTES(wroteAt) };
+		
+		if (w->fp)
+		{
+			FILE *fp = w->fp;
+			
+			zroomDrain(w);
+			w->fp = 0;
+			if (fseek(fp, w->meshHeaderPtr, SEEK_SET)
+				|| fwrite(tmp, 1, sizeof(tmp), fp) != sizeof(tmp)
+			)
+				w->failed = true;
+			if (fclose(fp))
+				w->failed = true;
+			buffer_free(&w->out);
+		}
+		else
+			memcpy(w->out.data + w->meshHeaderPtr, tmp, sizeof(tmp));
+	}
+	
+	if (w->opt.yaz0)
+	{
+		double traceStart = trace_now();
+		int threadNum = w->opt.threads ? w->opt.threads : sgThreads;
+		size_t len;
+		void *data;
+		
+		if (threadNum <= 0)
+			threadNum = sysconf(_SC_NPROCESSORS_ONLN);
+		data = yaz0_encode(w->out.data, w->out.len, w->opt.yaz0, threadNum, &len);
+		
+		Log("compressed %zu bytes to %zu with Yaz0", w->out.len, len);
+		trace_span("yaz0 encode", traceStart, 0);
+		
+		buffer_free(&w->out);
+		w->out.data = data;
+		w->out.len = w->out.cap = len;
+		
+		if (w->yaz0Fp)
+		{
+			FILE *fp = w->yaz0Fp;
+			
+			w->yaz0Fp = 0;
+			if (fwrite(data, 1, len, fp) != len)
+				w->failed = true;
+			if (fclose(fp))
+				w->failed = true;
+			buffer_free(&w->out);
+		}
+	}
+	
+	free(w->wroteAt);
+	w->wroteAt = 0;
+	
+	if (w->failed)
+		die("failed to write zroom");
+}
+
+/* releases what a writer still holds when writing fails partway;
+ * whatever reached a file is left there
+ */
+static void zroomAbandon(struct zroomWriter *w)
+{
+	if (w->fp)
+		fclose(w->fp);
+	if (w->yaz0Fp)
+		fclose(w->yaz0Fp);
+	buffer_free(&w->out);
+	zroomSharedFree(w->shared);
+	free(w->wroteAt);
+	memset(w, 0, sizeof(*w));
+}
+
+static void group_merge(struct group *dst, struct group *src)
+{
+	struct triangle *t;
+	
+	if (!dst || !src)
+		return;
+	
+	if (src->child)
+	{
+		struct group *dst = src;
+		struct group *next = 0;
+		
+		for (struct group *src = dst->child; src; src = next)
+		{
+			next = src->next;
+			group_merge(dst, src);
+		}
+	}
+	
+	for (t = dst->tri; t && t->next; )
+		t = t->next;
+	
+	if (t)
+		t->next = src->tri;
+	else
+		dst->tri = src->tri;
+	free(src);
+}
+
+static void group_bounds_recursive(const struct group *g, struct bbox *bbox)
+{
+	struct triangle *t;
+	
+	if (!g || !bbox)
+		return;
+	
+	for (t = g->tri; t; t = t->next)
+	{
+#define DO_BOUNDS(V, X, FUNC) \
+	bbox->V = FUNC( \
+		bbox->V \
+		, t->v[0].X \
+		, t->v[1].X \
+		, t->v[2].X \
+	)
+		DO_BOUNDS(xmin, x, min4_int);
+		DO_BOUNDS(ymin, y, min4_int);
+		DO_BOUNDS(zmin, z, min4_int);
+		
+		DO_BOUNDS(xmax, x, max4_int);
+		DO_BOUNDS(ymax, y, max4_int);
+		DO_BOUNDS(zmax, z, max4_int);
+#undef DO_BOUNDS
+	}
+	
+	if (g->child)
+		group_bounds_recursive(g->child, bbox);
+}
+
+static struct bbox group_bounds(const struct group *g)
+{
+	struct bbox result = BBOX_INIT_V;
+	
+	if (!g)
+		return result;
+	
+	group_bounds_recursive(g, &result);
+	
+	return result;
+}
+
+static bool triangle_inside_bbox(const struct triangle t, const struct bbox bb)
+{
+	/* use center point */
+	struct vertex v;
+	
+	v.x = (t.v[0].x + t.v[1].x + t.v[2].x) / 3;
+	v.y = (t.v[0].y + t.v[1].y + t.v[2].y) / 3;
+	v.z = (t.v[0].z + t.v[1].z + t.v[2].z) / 3;
+	
+	return v.x >= bb.xmin
+		&& v.x <= bb.xmax
+		&& v.y >= bb.ymin
+		&& v.y <= bb.ymax
+		&& v.z >= bb.zmin
+		&& v.z <= bb.zmax
+	;
+}
+
+/* grows bbox so each axis is evenly divisible by its number of cells,
+ * into a cube if the division asks for one; writes cell sizes to sec
+ */
+static void bbox_fit(struct bbox *bbox, const struct room_division *div, int sec[3])
+{
+	int largest = max4_int(0, bbox->xmax - bbox->xmin, bbox->ymax - bbox->ymin, bbox->zmax - bbox->zmin);
+	int len[3] = { bbox->xmax - bbox->xmin, bbox->ymax - bbox->ymin, bbox->zmax - bbox->zmin };
+	int tmp = 0;
+	
+	/* ensure that each is evenly divisible by the number of divisions */
+	for (int i = 0; i < 3; ++i)
+	{
+		if (div->cube)
+			len[i] = largest;
+		while (len[i] % div->n[i])
+			++len[i];
+	}
+	
+	/* grow each axis to its length, alternating sides */
+	//int delta;
+	//if ((delta = (largest - (bbox->xmax - bbox->xmin))) != 0) // XXX old idea
+	//	bbox->xmax += delta / 2, bbox->xmin -= delta / 2;
+#define DO_ONE(VMIN, VMAX, LEN) \
+	while ((bbox->VMAX - bbox->VMIN) != LEN) \
 		((++tmp)&1) ? (bbox->VMAX += 1) : (bbox->VMIN -= 1);
-	DO_ONE(xmin, xmax)
-	DO_ONE(ymin, ymax)
-	DO_ONE(zmin, zmax)
+	DO_ONE(xmin, xmax, len[0])
+	DO_ONE(ymin, ymax, len[1])
+	DO_ONE(zmin, zmax, len[2])
 #undef DO_ONE
 	
-	for (int x = 0; x < div; ++x)
+	for (int i = 0; i < 3; ++i)
+		sec[i] = len[i] / div->n[i];
+}
+
+/* bounds of cell x,y,z within a fitted bbox */
+static struct bbox bbox_cell(const struct bbox *bbox, const int sec[3], int x, int y, int z)
+{
+	struct bbox bb = {
+		.xmin = bbox->xmin + sec[0] * x,
+		.ymin = bbox->ymin + sec[1] * y,
+		.zmin = bbox->zmin + sec[2] * z
+	};
+	bb.xmax = bb.xmin + sec[0];
+	bb.ymax = bb.ymin + sec[1];
+	bb.zmax = bb.zmin + sec[2];
+	
+	return bb;
+}
+
+static void group_divide(struct group *g, struct bbox *bbox, const struct room_division divisions[], const int divisionsNum)
+{
+	const int *div;
+	int sec[3];
+	double traceStart;
+	
+	if (!divisionsNum)
+		return;
+	
+	div = divisions[0].n;
+	traceStart = trace_now();
+	bbox_fit(bbox, &divisions[0], sec);
+	
+	for (int x = 0; x < div[0]; ++x)
+	{
+		for (int y = 0; y < div[1]; ++y)
+		{
+			for (int z = 0; z < div[2]; ++z)
+			{
+				//struct triangle *prev = g->tri;
+				struct triangle *next = 0;
+				struct group *child = calloc(1, sizeof(*child));
+				struct bbox bb = bbox_cell(bbox, sec, x, y, z);
+				
+				/* setup */
+				child->bbox = bb;
+				for (struct triangle *t = g->tri; t; t = next)
+				{
+					next = t->next;
+					if (next)
+					{
+						if (triangle_inside_bbox(*next, bb))
+						{
+							void *nnext = next->next;
+							
+							next->next = child->tri;
+							child->tri = next;
+							
+							t->next = nnext;
+							next = t;
+						}
+					}
+					#if 0 /* XXX misc old experments */
+					else if (triangle_inside_bbox(*t, bb))
+					{
+						Log("match");
+					}
+					continue;
+					if (triangle_inside_bbox(*t, bb))
+					{
+						if (prev)
+						{
+							if (prev == g->tri)
+								g->tri = next;
+							else
+								prev->next = next;
+						}
+						t->next = child->tri;
+						child->tri = t;
+					}
+					else
+						prev = t;
+					#endif
+				}
+				
+				/* debug helper: add 3D bbox to output */
+				if (false)
+				{
+					struct triangle *t;
+					#define QVTX(X, Y, Z) (struct vertex){bb.X, bb.Y, bb.Z, {0}}
+					struct vertex v[] = {
+						QVTX(xmax, ymin, zmin),
+						QVTX(xmax, ymin, zmax),
+						QVTX(xmin, ymin, zmax),
+						QVTX(xmin, ymin, zmin),
+						QVTX(xmax, ymax, zmin),
+						QVTX(xmax, ymax, zmax),
+						QVTX(xmin, ymax, zmax),
+						QVTX(xmin, ymax, zmin)
+					};
+					#define PUSH_TRI(A, B, C) \
+						t = calloc(1, sizeof(*t)); \
+						t->next = child->tri; \
+						t->v[0] = v[A - 1]; \
+						t->v[1] = v[B - 1]; \
+						t->v[2] = v[C - 1]; \
+						child->tri = t;
+					PUSH_TRI(2, 4, 1)
+					PUSH_TRI(8, 6, 5)
+					PUSH_TRI(5, 2, 1)
+					PUSH_TRI(6, 3, 2)
+					PUSH_TRI(3, 8, 4)
+					PUSH_TRI(1, 8, 5)
+					PUSH_TRI(2, 3, 4)
+					PUSH_TRI(8, 7, 6)
+					PUSH_TRI(5, 6, 2)
+					PUSH_TRI(6, 7, 3)
+					PUSH_TRI(3, 7, 8)
+					PUSH_TRI(1, 4, 8)
+					#undef PUSH_TRI
+					#undef QVTX
+				}
+				
+				/* link in */
+				child->next = g->child;
+				g->child = child;
+				
+				/* subdivide */
+				if (divisionsNum > 1)
+					group_divide(child, &bb, divisions + 1, divisionsNum - 1);
+			}
+		}
+	}
+	
+	if (trace_on())
+	{
+		char detail[32];
+		
+		snprintf(detail, sizeof(detail), "%d levels left", divisionsNum);
+		trace_span("group_divide", traceStart, detail);
+	}
+}
+
+/* points triangles at the materials their own were merged into */
+static void group_remapMaterials(struct group *g)
+{
+	for ( ; g; g = g->next)
+	{
+		for (struct triangle *t = g->tri; t; t = t->next)
+			if (t->mat && t->mat->mergedInto)
+				t->mat = t->mat->mergedInto;
+		
+		if (g->child)
+			group_remapMaterials(g->child);
+	}
+}
+
+static void group_free(struct group *g)
+{
+	struct triangle *tNext = 0;
+	struct group *gNext = 0;
+	
+	for ( ; g; g = gNext)
+	{
+		gNext = g->next;
+		
+		for (struct triangle *t = g->tri; t; t = tNext)
+		{
+			tNext = t->next;
+			
+			free(t);
+		}
+		
+		if (g->child)
+			group_free(g->child);
+		
+		free(g);
+	}
+}
+
+/* first cell along one axis whose inclusive range contains c, or -1 */
+static int stream_axisCell(const int c, const int min, const int sec, const int div)
+{
+	int d = c - min;
+	int k;
+	
+	if (d < 0)
+		return -1;
+	
+	if (!sec)
+		return d ? -1 : 0;
+	
+	k = d ? (d - 1) / sec : 0;
+	
+	return k < div ? k : -1;
+}
+
+/* compiles num spilled triangles read from src, keeping at most
+ * budget triangles resident; cells that don't fit are partitioned
+ * into bucket files on disk and processed one at a time
+ */
+static void stream_cell(struct zroomWriter *w, FILE *src, long num, struct bbox bbox, const struct room_division divisions[], const int divisionsNum, const long budget)
+{
+	if (!num)
+		return;
+	
+	rewind(src);
+	
+	/* fits, or can't be divided any further */
+	if (num <= budget || !divisionsNum)
+	{
+		if (num > budget)
+			Log("cell of %ld triangles exceeds budget; splitting it across groups", num);
+		
+		while (num > 0)
+		{
+			struct group *g = calloc(1, sizeof(*g));
+			long n = num < budget ? num : budget;
+			
+			for (long i = 0; i < n; ++i)
+			{
+				struct triangle *t = malloc(sizeof(*t));
+				
+				if (fread(t, 1, sizeof(*t), src) != sizeof(*t))
+					die("failed to read spilled triangles");
+				
+				t->next = g->tri;
+				g->tri = t;
+			}
+			
+			if (divisionsNum)
+			{
+				struct bbox bb = bbox;
+				
+				group_divide(g, &bb, divisions, divisionsNum);
+			}
+			
+			zroomWriteTree(w, g);
+			group_free(g);
+			num -= n;
+		}
+		return;
+	}
+	
+	/* partition into buckets, the last one holding any stragglers */
+	{
+		const int *div = divisions[0].n;
+		const int cellNum = div[0] * div[1] * div[2];
+		FILE **bucket = calloc(cellNum + 1, sizeof(*bucket));
+		long *count = calloc(cellNum + 1, sizeof(*count));
+		int sec[3];
+		struct triangle t;
+		
+		bbox_fit(&bbox, &divisions[0], sec);
+		
+		for (long i = 0; i < num; ++i)
+		{
+			int x;
+			int y;
+			int z;
+			int idx = cellNum;
+			
+			if (fread(&t, 1, sizeof(t), src) != sizeof(t))
+				die("failed to read spilled triangles");
+			
+			x = stream_axisCell((t.v[0].x + t.v[1].x + t.v[2].x) / 3, bbox.xmin, sec[0], div[0]);
+			y = stream_axisCell((t.v[0].y + t.v[1].y + t.v[2].y) / 3, bbox.ymin, sec[1], div[1]);
+			z = stream_axisCell((t.v[0].z + t.v[1].z + t.v[2].z) / 3, bbox.zmin, sec[2], div[2]);
+			if (x >= 0 && y >= 0 && z >= 0)
+				idx = (x * div[1] + y) * div[2] + z;
+			
+			if (!bucket[idx] && !(bucket[idx] = tmpfile()))
+				die("failed to create tmpfile");
+			fwrite(&t, 1, sizeof(t), bucket[idx]);
+			count[idx] += 1;
+		}
+		
+		/* process each bucket */
+		for (int i = 0; i <= cellNum; ++i)
+		{
+			struct bbox bb = bbox;
+			
+			if (!bucket[i])
+				continue;
+			
+			if (i < cellNum)
+				bb = bbox_cell(&bbox, sec, i / (div[1] * div[2]), (i / div[2]) % div[1], i % div[2]);
+			
+			stream_cell(w, bucket[i], count[i], bb, divisions + 1, divisionsNum - 1, budget);
+			fclose(bucket[i]);
+		}
+		
+		free(bucket);
+		free(count);
+	}
+}
+
+/* room_writeFunc adapters */
+static size_t writeFile(void *udata, const void *data, size_t len)
+{
+	return fwrite(data, 1, len, udata);
+}
+
+static size_t writeBuffer(void *udata, const void *data, size_t len)
+{
+	buffer_write(udata, data, len);
+	
+	return len;
+}
+
+/* state of a wavefront file being written */
+struct wavefrontWriter
+{
+	room_writeFunc write;
+	void *udata;
+	int v; /* wavefront vertex indexing starts at 1 */
+};
+
+static void wavefrontPrintf(struct wavefrontWriter *w, const char *fmt, ...)
+{
+	char line[256];
+	va_list args;
+	int len;
+	
+	va_start(args, fmt);
+		len = vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+	
+	if (len > 0)
+		w->write(w->udata, line, len);
+}
+
+static void wavefrontWriteGroups(struct wavefrontWriter *w, struct group *group)
+{
+	/* write every group */
+	for (struct group *g = group; g; g = g->next)
+	{
+		wavefrontPrintf(w, "g %p\n", (void*)g);
+		
+		for (struct triangle *t = g->tri; t; t = t->next)
+		{
+			for (int i = 0; i < 3; ++i)
+				wavefrontPrintf(w, "v %d %d %d\n"
+					, t->v[i].x, t->v[i].y, t->v[i].z
+				);
+			wavefrontPrintf(w, "f %d %d %d\n", w->v, w->v + 1, w->v + 2);
+			w->v += 3;
+		}
+		
+		/* recursion */
+		if (g->child)
+			wavefrontWriteGroups(w, g->child);
+	}
+}
+
+/* zero area: coincident or collinear vertices */
+static bool triangle_degenerate(const struct triangle *t)
+{
+	int64_t ux = t->v[1].x - t->v[0].x;
+	int64_t uy = t->v[1].y - t->v[0].y;
+	int64_t uz = t->v[1].z - t->v[0].z;
+	int64_t vx = t->v[2].x - t->v[0].x;
+	int64_t vy = t->v[2].y - t->v[0].y;
+	int64_t vz = t->v[2].z - t->v[0].z;
+	
+	return uy * vz - uz * vy == 0
+		&& uz * vx - ux * vz == 0
+		&& ux * vy - uy * vx == 0
+	;
+}
+
+/* orders vertices by position, then by texcoords, colour and flags */
+static int vertex_compare(const struct vertex *a, const struct vertex *b)
+{
+	if (a->x != b->x)
+		return a->x - b->x;
+	if (a->y != b->y)
+		return a->y - b->y;
+	if (a->z != b->z)
+		return a->z - b->z;
+	
+	return memcmp(a->other, b->other, sizeof(a->other));
+}
+
+/* vertices of a triangle rotated to start at its smallest one, so the
+ * same triangle compares equal whichever vertex it starts on (winding
+ * is kept, so back-to-back faces are not duplicates); texcoords and
+ * colours are part of each vertex, so faces that share positions but
+ * are shaded or mapped differently are not duplicates either
+ */
+static void triangle_canonical(const struct triangle *t, struct vertex dst[3])
+{
+	int first = 0;
+	
+	for (int i = 1; i < 3; ++i)
+		if (vertex_compare(t->v + i, t->v + first) < 0)
+			first = i;
+	
+	for (int i = 0; i < 3; ++i)
+		dst[i] = t->v[(first + i) % 3];
+}
+
+/* removes degenerate triangles from a group tree, and those duplicating
+ * an earlier triangle's vertices and material (via hash of seen ones)
+ */
+static void group_cleanup(struct group *g, struct triangle **hash, uint32_t hashMask, int *degenerate, int *duplicate)
+{
+	for ( ; g; g = g->next)
+	{
+		for (struct triangle **tp = &g->tri; *tp; )
+		{
+			struct triangle *t = *tp;
+			bool drop = false;
+			
+			if (triangle_degenerate(t))
+			{
+				*degenerate += 1;
+				drop = true;
+			}
+			else
+			{
+				struct vertex key[3];
+				struct vertex other[3];
+				uint32_t h;
+				
+				triangle_canonical(t, key);
+				h = fnv1a32(key, sizeof(key)) ^ fnv1a32(&t->mat, sizeof(t->mat));
+				
+				for (h &= hashMask; hash[h]; h = (h + 1) & hashMask)
+				{
+					triangle_canonical(hash[h], other);
+					if (hash[h]->mat == t->mat && !memcmp(key, other, sizeof(key)))
+						break;
+				}
+				
+				if (hash[h])
+				{
+					*duplicate += 1;
+					drop = true;
+				}
+				else
+					hash[h] = t;
+			}
+			
+			if (drop)
+			{
+				*tp = t->next;
+				free(t);
+			}
+			else
+				tp = &t->next;
+		}
+		
+		if (g->child)
+			group_cleanup(g->child, hash, hashMask, degenerate, duplicate);
+	}
+}
+
+static int group_countTriangles(const struct group *g)
+{
+	int num = 0;
+	
+	for ( ; g; g = g->next)
+	{
+		for (const struct triangle *t = g->tri; t; t = t->next)
+			num += 1;
+		
+		if (g->child)
+			num += group_countTriangles(g->child);
+	}
+	
+	return num;
+}
+
+/* level of detail: quadric edge collapse within a single group */
+#if 1
+struct lodVertex
+{
+	struct vertex v;
+	double q[10]; /* symmetric 4x4 error quadric */
+	double area; /* total weight in q */
+	int *tri; /* triangles referencing this vertex (may be stale) */
+	int triNum;
+	int triCap;
+	uint32_t stamp; /* bumped whenever its candidate collapses change */
+	bool locked; /* on a mesh, material or cell border */
+	bool alive;
+};
+
+struct lodTriangle
+{
+	int v[3];
+	struct material *mat;
+	bool alive;
+};
+
+struct lodCollapse
+{
+	double cost;
+	int from; /* removed */
+	int to; /* kept */
+	uint32_t stampFrom;
+	uint32_t stampTo;
+};
+
+struct lodMesh
+{
+	struct lodVertex *vtx;
+	int vtxNum;
+	struct lodTriangle *tri;
+	int triNum;
+	int triAlive;
+	struct lodCollapse *heap;
+	int heapNum;
+	int heapCap;
+};
+
+static void lod_heapPush(struct lodMesh *m, struct lodCollapse c)
+{
+	int i;
+	
+	if (m->heapNum >= m->heapCap)
+	{
+		m->heapCap = m->heapCap ? m->heapCap * 2 : 256;
+		m->heap = realloc(m->heap, m->heapCap * sizeof(*m->heap));
+	}
+	
+	for (i = m->heapNum++; i > 0 && m->heap[(i - 1) / 2].cost > c.cost; i = (i - 1) / 2)
+		m->heap[i] = m->heap[(i - 1) / 2];
+	m->heap[i] = c;
+}
+
+static struct lodCollapse lod_heapPop(struct lodMesh *m)
+{
+	struct lodCollapse top = m->heap[0];
+	struct lodCollapse last = m->heap[--m->heapNum];
+	int i = 0;
+	
+	for (;;)
+	{
+		int c = i * 2 + 1;
+		
+		if (c >= m->heapNum)
+			break;
+		if (c + 1 < m->heapNum && m->heap[c + 1].cost < m->heap[c].cost)
+			c += 1;
+		if (last.cost <= m->heap[c].cost)
+			break;
+		m->heap[i] = m->heap[c];
+		i = c;
+	}
+	if (m->heapNum)
+		m->heap[i] = last;
+	
+	return top;
+}
+
+/* error of quadric q at a vertex's position */
+static double lod_quadricError(const double q[10], const struct vertex *v)
+{
+	double x = v->x;
+	double y = v->y;
+	double z = v->z;
+	
+	return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x
+		+ q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y
+		+ q[7] * z * z + 2 * q[8] * z
+		+ q[9]
+	;
+}
+
+static void lod_normal(const struct vertex *a, const struct vertex *b, const struct vertex *c, double n[3])
+{
+	double e1[3] = { b->x - a->x, b->y - a->y, b->z - a->z };
+	double e2[3] = { c->x - a->x, c->y - a->y, c->z - a->z };
+	
+	n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+	n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+	n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+static void lod_addTriangleRef(struct lodVertex *v, int tri)
+{
+	if (v->triNum >= v->triCap)
+	{
+		v->triCap = v->triCap ? v->triCap * 2 : 8;
+		v->tri = realloc(v->tri, v->triCap * sizeof(*v->tri));
+	}
+	v->tri[v->triNum++] = tri;
+}
+
+/* queues collapsing every unlocked neighbor of v into v, and v into them */
+static void lod_pushEdges(struct lodMesh *m, int v)
+{
+	struct lodVertex *a = m->vtx + v;
+	
+	for (int i = 0; i < a->triNum; ++i)
+	{
+		struct lodTriangle *t = m->tri + a->tri[i];
+		
+		if (!t->alive)
+			continue;
+		
+		for (int k = 0; k < 3; ++k)
+		{
+			int w = t->v[k];
+			struct lodVertex *b = m->vtx + w;
+			double q[10];
+			double area;
+			
+			if (w == v)
+				continue;
+			
+			area = a->area + b->area;
+			if (area <= 0)
+				area = 1;
+			
+			for (int j = 0; j < 10; ++j)
+				q[j] = (a->q[j] + b->q[j]) / area;
+			
+			/* costs are mean squared distances, comparable to maxError */
+			if (!a->locked)
+				lod_heapPush(m, (struct lodCollapse){
+					lod_quadricError(q, &b->v), v, w, a->stamp, b->stamp
+				});
+			if (!b->locked)
+				lod_heapPush(m, (struct lodCollapse){
+					lod_quadricError(q, &a->v), w, v, b->stamp, a->stamp
+				});
+		}
+	}
+}
+
+/* whether moving vertex from onto to flips any surviving triangle */
+static bool lod_collapseFlips(struct lodMesh *m, int from, int to)
+{
+	struct lodVertex *a = m->vtx + from;
+	
+	for (int i = 0; i < a->triNum; ++i)
+	{
+		struct lodTriangle *t = m->tri + a->tri[i];
+		struct vertex p[3];
+		double before[3];
+		double after[3];
+		bool hasTo = false;
+		
+		if (!t->alive)
+			continue;
+		
+		for (int k = 0; k < 3; ++k)
+		{
+			p[k] = m->vtx[t->v[k]].v;
+			hasTo |= t->v[k] == to;
+		}
+		if (hasTo)
+			continue;
+		
+		lod_normal(p, p + 1, p + 2, before);
+		for (int k = 0; k < 3; ++k)
+			if (t->v[k] == from)
+				p[k] = m->vtx[to].v;
+		lod_normal(p, p + 1, p + 2, after);
+		
+		if (before[0] * after[0] + before[1] * after[1] + before[2] * after[2] <= 0)
+			return true;
+	}
+	
+	return false;
+}
+
+/* welds a group's triangles into an indexed mesh with quadrics and borders */
+static void lod_build(struct lodMesh *m, struct group *g)
+{
+	int hashCap = 16;
+	int *hash;
+	int edgeCap;
+	struct { int a; int b; int num; } *edge;
+	
+	for (struct triangle *t = g->tri; t; t = t->next)
+		m->triNum += 1;
+	while (hashCap < m->triNum * 6)
+		hashCap *= 2;
+	hash = malloc(hashCap * sizeof(*hash));
+	memset(hash, -1, hashCap * sizeof(*hash));
+	m->vtx = calloc(m->triNum * 3, sizeof(*m->vtx));
+	m->tri = calloc(m->triNum, sizeof(*m->tri));
+	m->triAlive = m->triNum;
+	
+	/* weld identical vertices */
+	{
+		int i = 0;
+		
+		for (struct triangle *t = g->tri; t; t = t->next, ++i)
+		{
+			m->tri[i].mat = t->mat;
+			m->tri[i].alive = true;
+			
+			for (int k = 0; k < 3; ++k)
+			{
+				uint32_t h = fnv1a32(&t->v[k], sizeof(t->v[k])) & (hashCap - 1);
+				
+				while (hash[h] >= 0 && memcmp(&m->vtx[hash[h]].v, &t->v[k], sizeof(t->v[k])))
+					h = (h + 1) & (hashCap - 1);
+				if (hash[h] < 0)
+				{
+					hash[h] = m->vtxNum++;
+					m->vtx[hash[h]].v = t->v[k];
+					m->vtx[hash[h]].alive = true;
+				}
+				m->tri[i].v[k] = hash[h];
+				lod_addTriangleRef(m->vtx + hash[h], i);
+			}
+		}
+	}
+	
+	/* area-weighted plane quadrics; material borders */
+	for (int i = 0; i < m->triNum; ++i)
+	{
+		struct lodTriangle *t = m->tri + i;
+		struct vertex *p = &m->vtx[t->v[0]].v;
+		double n[3];
+		double len;
+		
+		lod_normal(p, &m->vtx[t->v[1]].v, &m->vtx[t->v[2]].v, n);
+		len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		
+		for (int k = 0; k < 3; ++k)
+		{
+			struct lodVertex *v = m->vtx + t->v[k];
+			
+			if (m->tri[v->tri[0]].mat != t->mat)
+				v->locked = true;
+		}
+		
+		if (len > 0)
+		{
+			double a = n[0] / len;
+			double b = n[1] / len;
+			double c = n[2] / len;
+			double d = -(a * p->x + b * p->y + c * p->z);
+			double w = len * 0.5;
+			double q[10] = {
+				a * a, a * b, a * c, a * d
+				, b * b, b * c, b * d
+				, c * c, c * d
+				, d * d
+			};
+			
+			for (int k = 0; k < 3; ++k)
+			{
+				for (int j = 0; j < 10; ++j)
+					m->vtx[t->v[k]].q[j] += q[j] * w;
+				m->vtx[t->v[k]].area += w;
+			}
+		}
+	}
+	
+	/* mesh and cell borders: edges not shared by exactly two triangles */
+	edgeCap = hashCap * 2;
+	edge = malloc(edgeCap * sizeof(*edge));
+	for (int i = 0; i < edgeCap; ++i)
+		edge[i].num = 0;
+	for (int i = 0; i < m->triNum; ++i)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			int a = min_int(m->tri[i].v[k], m->tri[i].v[(k + 1) % 3]);
+			int b = max_int(m->tri[i].v[k], m->tri[i].v[(k + 1) % 3]);
+			uint32_t pair[2] = { a, b };
+			uint32_t h = fnv1a32(pair, sizeof(pair)) & (edgeCap - 1);
+			
+			while (edge[h].num && (edge[h].a != a || edge[h].b != b))
+				h = (h + 1) & (edgeCap - 1);
+			edge[h].a = a;
+			edge[h].b = b;
+			edge[h].num += 1;
+		}
+	}
+	for (int i = 0; i < edgeCap; ++i)
+	{
+		if (edge[i].num && edge[i].num != 2)
+		{
+			m->vtx[edge[i].a].locked = true;
+			m->vtx[edge[i].b].locked = true;
+		}
+	}
+	
+	free(edge);
+	free(hash);
+}
+
+/* collapses edges until at most targetTris remain or the next
+ * collapse would move the surface by more than maxError
+ */
+static void lod_reduce(struct lodMesh *m, int targetTris, double maxError)
+{
+	double maxCost = maxError > 0 ? maxError * maxError : -1;
+	
+	for (int i = 0; i < m->vtxNum; ++i)
+		lod_pushEdges(m, i);
+	
+	while (m->triAlive > targetTris && m->heapNum)
+	{
+		struct lodCollapse c = lod_heapPop(m);
+		struct lodVertex *from = m->vtx + c.from;
+		struct lodVertex *to = m->vtx + c.to;
+		
+		/* stale */
+		if (!from->alive
+			|| !to->alive
+			|| from->stamp != c.stampFrom
+			|| to->stamp != c.stampTo
+		)
+			continue;
+		
+		if (maxCost >= 0 && c.cost > maxCost)
+			break;
+		
+		if (lod_collapseFlips(m, c.from, c.to))
+			continue;
+		
+		/* move from's triangles onto to, dropping degenerate ones */
+		for (int i = 0; i < from->triNum; ++i)
+		{
+			struct lodTriangle *t = m->tri + from->tri[i];
+			bool hasTo = false;
+			
+			if (!t->alive)
+				continue;
+			
+			for (int k = 0; k < 3; ++k)
+				hasTo |= t->v[k] == c.to;
+			
+			if (hasTo)
+			{
+				t->alive = false;
+				m->triAlive -= 1;
+				continue;
+			}
+			
+			for (int k = 0; k < 3; ++k)
+				if (t->v[k] == c.from)
+					t->v[k] = c.to;
+			lod_addTriangleRef(to, from->tri[i]);
+		}
+		
+		for (int j = 0; j < 10; ++j)
+			to->q[j] += from->q[j];
+		to->area += from->area;
+		from->alive = false;
+		to->stamp += 1;
+		lod_pushEdges(m, c.to);
+	}
+}
+
+/* replaces a group's triangles with a simplified version */
+static void group_simplify(struct group *g, float ratio, float maxError)
+{
+	struct lodMesh m = {0};
+	struct triangle *tNext = 0;
+	
+	if (!g->tri)
+		return;
+	
+	lod_build(&m, g);
+	lod_reduce(&m, (int)(m.triNum * ratio + 0.5f), maxError);
+	
+	for (struct triangle *t = g->tri; t; t = tNext)
+	{
+		tNext = t->next;
+		free(t);
+	}
+	g->tri = 0;
+	
+	for (int i = m.triNum - 1; i >= 0; --i)
+	{
+		struct lodTriangle *lt = m.tri + i;
+		struct triangle *t;
+		
+		if (!lt->alive)
+			continue;
+		
+		t = calloc(1, sizeof(*t));
+		for (int k = 0; k < 3; ++k)
+			t->v[k] = m.vtx[lt->v[k]].v;
+		t->mat = lt->mat;
+		t->next = g->tri;
+		g->tri = t;
+	}
+	
+	for (int i = 0; i < m.vtxNum; ++i)
+		free(m.vtx[i].tri);
+	free(m.vtx);
+	free(m.tri);
+	free(m.heap);
+}
+#endif // level of detail
+
+/* deep copy of a group tree and its triangles */
+static struct group *group_clone(const struct group *g)
+{
+	struct group *head = 0;
+	struct group **tail = &head;
+	
+	for ( ; g; g = g->next)
+	{
+		struct group *c = malloc(sizeof(*c));
+		struct triangle **tTail = &c->tri;
+		
+		*c = *g;
+		c->next = 0;
+		for (const struct triangle *t = g->tri; t; t = t->next)
+		{
+			*tTail = Memdup(t, sizeof(*t));
+			tTail = &(*tTail)->next;
+		}
+		*tTail = 0;
+		c->child = group_clone(g->child);
+		
+		*tail = c;
+		tail = &c->next;
+	}
+	
+	return head;
+}
+
+/* gives a room its own copy of any storage it shares with snapshots,
+ * before it is modified
+ */
+static void roomOwn(struct room *room)
+{
+	struct material *mat = 0;
+	struct material **tail = &mat;
+	
+	if (!room || !room->shares)
+		return;
+	
+	if (--*room->shares)
+	{
+		/* old materials point to their copies while triangles are remapped */
+		for (struct material *m = room->mat; m; m = m->next)
+		{
+			struct material *c = Memdup(m, sizeof(*m));
+			
+			c->data = m->data ? Memdup(m->data, m->dataLen) : 0;
+			c->next = 0;
+			m->mergedInto = c;
+			*tail = c;
+			tail = &c->next;
+		}
+		room->group = group_clone(room->group);
+		group_remapMaterials(room->group);
+		for (struct material *m = room->mat; m; m = m->next)
+			m->mergedInto = 0;
+		room->mat = mat;
+	}
+	else
+		free(room->shares);
+	
+	room->shares = 0;
+}
+
+/* simplifies every group in a tree, returns triangles before and after */
+static void group_simplifyTree(struct group *g, float ratio, float maxError, int *before, int *after)
+{
+	for ( ; g; g = g->next)
+	{
+		for (struct triangle *t = g->tri; t; t = t->next)
+			*before += 1;
+		
+		group_simplify(g, ratio, maxError);
+		
+		for (struct triangle *t = g->tri; t; t = t->next)
+			*after += 1;
+		
+		if (g->child)
+			group_simplifyTree(g->child, ratio, maxError, before, after);
+	}
+}
+
+/* bounding volume hierarchy: binned sah build over a flat node array */
+#if 1
+#define BVH_BINS          16
+#define BVH_LEAF_MAX      4 /* always a leaf at or below this */
+#define BVH_DEPTH_MAX     64 /* deeper subtrees become leaves; bounds query stacks */
+#define BVH_PARALLEL_MIN  4096 /* smaller subtrees build on the current thread */
+
+struct bvhNode
+{
+	float min[3];
+	float max[3];
+	int first; /* leaf: first triangle; interior: left child, right is first + 1 */
+	int num; /* triangles in leaf; 0 = interior */
+};
+
+struct bvhTri
+{
+	float v[3][3];
+};
+
+struct room_bvh
+{
+	struct bvhNode *node;
+	struct bvhTri *tri; /* in leaf order */
+	int *triIndex; /* leaf order -> depth-first order through the room */
+	int nodeNum;
+	int triNum;
+};
+
+struct bvhBuild
+{
+	struct room_bvh *bvh;
+	float (*bounds)[2][3];
+	float (*centroid)[3];
+	int *order; /* permutation of triangles, partitioned as nodes split */
+	int threadsLeft;
+	pthread_mutex_t lock;
+};
+
+struct bvhTask
+{
+	struct bvhBuild *b;
+	int node;
+	int first;
+	int num;
+	int depth;
+};
+
+static void bvh_gather(struct buffer *dst, const struct group *g)
+{
+	for ( ; g; g = g->next)
+	{
+		for (const struct triangle *t = g->tri; t; t = t->next)
+		{
+			struct bvhTri b;
+			
+			for (int i = 0; i < 3; ++i)
+			{
+				b.v[i][0] = t->v[i].x;
+				b.v[i][1] = t->v[i].y;
+				b.v[i][2] = t->v[i].z;
+			}
+			buffer_write(dst, &b, sizeof(b));
+		}
+		
+		if (g->child)
+			bvh_gather(dst, g->child);
+	}
+}
+
+static float bvh_area(const float min[3], const float max[3])
+{
+	float x = max[0] - min[0];
+	float y = max[1] - min[1];
+	float z = max[2] - min[2];
+	
+	if (x < 0 || y < 0 || z < 0)
+		return 0;
+	
+	return x * y + y * z + z * x;
+}
+
+static void bvh_grow(float min[3], float max[3], const float bmin[3], const float bmax[3])
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		min[i] = fminf(min[i], bmin[i]);
+		max[i] = fmaxf(max[i], bmax[i]);
+	}
+}
+
+static void *bvh_buildWorker(void *arg);
+
+/* fills in a node for order[first, first + num), splitting it where
+ * the surface area heuristic says it is cheapest
+ */
+static void bvh_buildNode(struct bvhBuild *b, int node, int first, int num, int depth)
+{
+	struct bvhNode *n = &b->bvh->node[node];
+	float cmin[3] = { INFINITY, INFINITY, INFINITY };
+	float cmax[3] = { -INFINITY, -INFINITY, -INFINITY };
+	float bestCost = INFINITY;
+	int bestAxis = -1;
+	int bestSplit = 0;
+	int *order = b->order + first;
+	int mid;
+	
+	n->min[0] = n->min[1] = n->min[2] = INFINITY;
+	n->max[0] = n->max[1] = n->max[2] = -INFINITY;
+	for (int i = 0; i < num; ++i)
+	{
+		const float *c = b->centroid[order[i]];
+		
+		bvh_grow(n->min, n->max, b->bounds[order[i]][0], b->bounds[order[i]][1]);
+		bvh_grow(cmin, cmax, c, c);
+	}
+	n->first = first;
+	n->num = num;
+	
+	if (num <= BVH_LEAF_MAX || depth >= BVH_DEPTH_MAX)
+		return;
+	
+	/* bin centroids along each axis, then sweep the split planes */
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float binMin[BVH_BINS][3];
+		float binMax[BVH_BINS][3];
+		int binNum[BVH_BINS] = {0};
+		float rightArea[BVH_BINS];
+		float min[3];
+		float max[3];
+		float scale;
+		int count;
+		
+		if (cmax[axis] <= cmin[axis])
+			continue;
+		scale = BVH_BINS / (cmax[axis] - cmin[axis]);
+		
+		for (int i = 0; i < BVH_BINS; ++i)
+		{
+			binMin[i][0] = binMin[i][1] = binMin[i][2] = INFINITY;
+			binMax[i][0] = binMax[i][1] = binMax[i][2] = -INFINITY;
+		}
+		for (int i = 0; i < num; ++i)
+		{
+			int bin = (b->centroid[order[i]][axis] - cmin[axis]) * scale;
+			
+			bin = min_int(bin, BVH_BINS - 1);
+			binNum[bin] += 1;
+			bvh_grow(binMin[bin], binMax[bin], b->bounds[order[i]][0], b->bounds[order[i]][1]);
+		}
+		
+		/* right-to-left areas, so the left-to-right pass can cost each plane */
+		memcpy(min, binMin[BVH_BINS - 1], sizeof(min));
+		memcpy(max, binMax[BVH_BINS - 1], sizeof(max));
+		for (int i = BVH_BINS - 1; i > 0; --i)
+		{
+			bvh_grow(min, max, binMin[i], binMax[i]);
+			rightArea[i] = bvh_area(min, max);
+		}
+		
+		memcpy(min, binMin[0], sizeof(min));
+		memcpy(max, binMax[0], sizeof(max));
+		count = 0;
+		for (int i = 1; i < BVH_BINS; ++i)
+		{
+			float cost;
+			
+			count += binNum[i - 1];
+			bvh_grow(min, max, binMin[i - 1], binMax[i - 1]);
+			if (!count || count == num)
+				continue;
+			
+			cost = bvh_area(min, max) * count + rightArea[i] * (num - count);
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = i;
+			}
+		}
+	}
+	
+	/* all centroids coincide: halve the range so leaves stay small */
+	if (bestAxis < 0)
+		mid = num / 2;
+	else
+	{
+		float scale = BVH_BINS / (cmax[bestAxis] - cmin[bestAxis]);
+		float area = bvh_area(n->min, n->max);
+		
+		/* traversal costs about as much as one triangle test */
+		if (area > 0 && 1 + bestCost / area >= num && num <= BVH_LEAF_MAX * 4)
+			return;
+		
+		mid = 0;
+		for (int i = 0; i < num; ++i)
+		{
+			int bin = (b->centroid[order[i]][bestAxis] - cmin[bestAxis]) * scale;
+			
+			if (min_int(bin, BVH_BINS - 1) < bestSplit)
+			{
+				int tmp = order[i];
+				
+				order[i] = order[mid];
+				order[mid++] = tmp;
+			}
+		}
+	}
+	
+	pthread_mutex_lock(&b->lock);
+	n->first = b->bvh->nodeNum;
+	n->num = 0;
+	b->bvh->nodeNum += 2;
+	pthread_mutex_unlock(&b->lock);
+	
+	/* hand the left subtree to another thread if it is worth it */
+	{
+		struct bvhTask task = { b, n->first, first, mid, depth + 1 };
+		bool threaded = false;
+		pthread_t thread;
+		
+		if (num >= BVH_PARALLEL_MIN)
+		{
+			pthread_mutex_lock(&b->lock);
+			if (b->threadsLeft > 0)
+			{
+				b->threadsLeft -= 1;
+				threaded = true;
+			}
+			pthread_mutex_unlock(&b->lock);
+		}
+		
+		if (threaded && pthread_create(&thread, 0, bvh_buildWorker, &task))
+			die("failed to create thread");
+		if (!threaded)
+			bvh_buildWorker(&task);
+		
+		bvh_buildNode(b, task.node + 1, first + mid, num - mid, depth + 1);
+		
+		if (threaded)
+		{
+			pthread_join(thread, 0);
+			pthread_mutex_lock(&b->lock);
+			b->threadsLeft += 1;
+			pthread_mutex_unlock(&b->lock);
+		}
+	}
+}
+
+static void *bvh_buildWorker(void *arg)
+{
+	struct bvhTask *task = arg;
+	
+	bvh_buildNode(task->b, task->node, task->first, task->num, task->depth);
+	
+	return 0;
+}
+
+static bool bvh_rayBox(const struct bvhNode *n, const float o[3], const float inv[3], float tMax)
+{
+	float t0 = 0;
+	float t1 = tMax;
+	
+	for (int i = 0; i < 3; ++i)
+	{
+		float a;
+		float b;
+		
+		/* parallel to this slab, so inside it everywhere or nowhere;
+		 * a ray lying on a face would otherwise make 0 * inf = NaN
+		 */
+		if (isinf(inv[i]))
+		{
+			if (o[i] < n->min[i] || o[i] > n->max[i])
+				return false;
+			continue;
+		}
+		
+		a = (n->min[i] - o[i]) * inv[i];
+		b = (n->max[i] - o[i]) * inv[i];
+		t0 = fmaxf(t0, fminf(a, b));
+		t1 = fminf(t1, fmaxf(a, b));
+	}
+	
+	return t0 <= t1;
+}
+
+/* moller-trumbore, accepting either winding; returns distance or -1 */
+static float bvh_rayTri(const struct bvhTri *t, const float o[3], const float d[3])
+{
+	float e1[3];
+	float e2[3];
+	float p[3];
+	float q[3];
+	float s[3];
+	float det;
+	float u;
+	float v;
+	
+	for (int i = 0; i < 3; ++i)
+	{
+		e1[i] = t->v[1][i] - t->v[0][i];
+		e2[i] = t->v[2][i] - t->v[0][i];
+		s[i] = o[i] - t->v[0][i];
+	}
+	p[0] = d[1] * e2[2] - d[2] * e2[1];
+	p[1] = d[2] * e2[0] - d[0] * e2[2];
+	p[2] = d[0] * e2[1] - d[1] * e2[0];
+	
+	det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+	if (fabsf(det) < 1e-12f)
+		return -1;
+	
+	u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) / det;
+	if (u < 0 || u > 1)
+		return -1;
+	
+	q[0] = s[1] * e1[2] - s[2] * e1[1];
+	q[1] = s[2] * e1[0] - s[0] * e1[2];
+	q[2] = s[0] * e1[1] - s[1] * e1[0];
+	
+	v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) / det;
+	if (v < 0 || u + v > 1)
+		return -1;
+	
+	return (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) / det;
+}
+
+/* separating axis test between a triangle and a box given as
+ * its center and half extents
+ */
+static bool bvh_triBox(const struct bvhTri *t, const float c[3], const float h[3])
+{
+	float v[3][3];
+	float e[3][3];
+	
+	for (int i = 0; i < 3; ++i)
+		for (int k = 0; k < 3; ++k)
+			v[i][k] = t->v[i][k] - c[k];
+	for (int i = 0; i < 3; ++i)
+		for (int k = 0; k < 3; ++k)
+			e[i][k] = v[(i + 1) % 3][k] - v[i][k];
+	
+	/* box face normals */
+	for (int k = 0; k < 3; ++k)
+		if (fminf(v[0][k], fminf(v[1][k], v[2][k])) > h[k]
+			|| fmaxf(v[0][k], fmaxf(v[1][k], v[2][k])) < -h[k]
+		)
+			return false;
+	
+	/* cross products of box axes and triangle edges */
+	for (int i = 0; i < 3; ++i)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			float a[3] = {0};
+			float p0;
+			float p1;
+			float p2;
+			float r;
+			
+			/* axis = unit(k) x e[i] */
+			a[(k + 1) % 3] = -e[i][(k + 2) % 3];
+			a[(k + 2) % 3] = e[i][(k + 1) % 3];
+			
+			p0 = v[0][0] * a[0] + v[0][1] * a[1] + v[0][2] * a[2];
+			p1 = v[1][0] * a[0] + v[1][1] * a[1] + v[1][2] * a[2];
+			p2 = v[2][0] * a[0] + v[2][1] * a[1] + v[2][2] * a[2];
+			r = h[0] * fabsf(a[0]) + h[1] * fabsf(a[1]) + h[2] * fabsf(a[2]);
+			
+			if (fminf(p0, fminf(p1, p2)) > r || fmaxf(p0, fmaxf(p1, p2)) < -r)
+				return false;
+		}
+	}
+	
+	/* triangle normal */
+	{
+		float n[3] = {
+			e[0][1] * e[1][2] - e[0][2] * e[1][1]
+			, e[0][2] * e[1][0] - e[0][0] * e[1][2]
+			, e[0][0] * e[1][1] - e[0][1] * e[1][0]
+		};
+		float d = n[0] * v[0][0] + n[1] * v[0][1] + n[2] * v[0][2];
+		float r = h[0] * fabsf(n[0]) + h[1] * fabsf(n[1]) + h[2] * fabsf(n[2]);
+		
+		if (fabsf(d) > r)
+			return false;
+	}
+	
+	return true;
+}
+
+/* closest point on a triangle (ericson, real-time collision detection) */
+static void bvh_closest(const struct bvhTri *t, const float p[3], float dst[3])
+{
+	const float *a = t->v[0];
+	const float *b = t->v[1];
+	const float *c = t->v[2];
+	float ab[3];
+	float ac[3];
+	float ap[3];
+	float bp[3];
+	float cp[3];
+	float d1, d2, d3, d4, d5, d6, va, vb, vc, v, w;
+	
+	for (int i = 0; i < 3; ++i)
+	{
+		ab[i] = b[i] - a[i];
+		ac[i] = c[i] - a[i];
+		ap[i] = p[i] - a[i];
+		bp[i] = p[i] - b[i];
+		cp[i] = p[i] - c[i];
+	}
+#define DOT(A, B) ((A)[0] * (B)[0] + (A)[1] * (B)[1] + (A)[2] * (B)[2])
+	d1 = DOT(ab, ap);
+	d2 = DOT(ac, ap);
+	d3 = DOT(ab, bp);
+	d4 = DOT(ac, bp);
+	d5 = DOT(ab, cp);
+	d6 = DOT(ac, cp);
+#undef DOT
+	
+	if (d1 <= 0 && d2 <= 0)
+	{
+		memcpy(dst, a, sizeof(float[3]));
+		return;
+	}
+	if (d3 >= 0 && d4 <= d3)
+	{
+		memcpy(dst, b, sizeof(float[3]));
+		return;
+	}
+	if (d6 >= 0 && d5 <= d6)
+	{
+		memcpy(dst, c, sizeof(float[3]));
+		return;
+	}
+	
+	vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0)
+	{
+		v = d1 / (d1 - d3);
+		for (int i = 0; i < 3; ++i)
+			dst[i] = a[i] + ab[i] * v;
+		return;
+	}
+	
+	vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0)
+	{
+		w = d2 / (d2 - d6);
+		for (int i = 0; i < 3; ++i)
+			dst[i] = a[i] + ac[i] * w;
+		return;
+	}
+	
+	va = d3 * d6 - d5 * d4;
+	if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0)
+	{
+		w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		for (int i = 0; i < 3; ++i)
+			dst[i] = b[i] + (c[i] - b[i]) * w;
+		return;
+	}
+	
+	v = vb / (va + vb + vc);
+	w = vc / (va + vb + vc);
+	for (int i = 0; i < 3; ++i)
+		dst[i] = a[i] + ab[i] * v + ac[i] * w;
+}
+
+static float bvh_boxDistSq(const struct bvhNode *n, const float p[3])
+{
+	float d = 0;
+	
+	for (int i = 0; i < 3; ++i)
+	{
+		float e = fmaxf(0, fmaxf(n->min[i] - p[i], p[i] - n->max[i]));
+		
+		d += e * e;
+	}
+	
+	return d;
+}
+#endif // bounding volume hierarchy
+
+/* culling simulation: per-group work, as the writer would compile it */
+#if 1
+struct cullGroup
+{
+	float min[3];
+	float max[3];
+	struct room_cullStats stats;
+};
+
+struct room_cull
+{
+	struct cullGroup *group;
+	int groupNum;
+};
+
+/* inward-facing planes as a, b, c, d; inside when ax + by + cz + d >= 0 */
+static void cull_frustum(const struct room_camera *cam, float plane[6][4])
+{
+	float f[3];
+	float r[3];
+	float u[3];
+	float up[3] = { 0, 1, 0 };
+	float len = 0;
+	float tanY = tanf(cam->fovy * 0.5f * 3.14159265f / 180);
+	float tanX = tanY * cam->aspect;
+	float n[6][3];
+	float ahead;
+	
+	for (int i = 0; i < 3; ++i)
+	{
+		f[i] = cam->target[i] - cam->pos[i];
+		len += f[i] * f[i];
+	}
+	len = sqrtf(len);
+	if (len <= 0)
+	{
+		len = 1;
+		f[2] = -1;
+	}
+	for (int i = 0; i < 3; ++i)
+		f[i] /= len;
+	
+	/* looking straight up or down */
+	if (fabsf(f[1]) > 0.999f)
+	{
+		up[1] = 0;
+		up[2] = 1;
+	}
+	
+	r[0] = f[1] * up[2] - f[2] * up[1];
+	r[1] = f[2] * up[0] - f[0] * up[2];
+	r[2] = f[0] * up[1] - f[1] * up[0];
+	len = sqrtf(r[0] * r[0] + r[1] * r[1] + r[2] * r[2]);
+	for (int i = 0; i < 3; ++i)
+		r[i] /= len;
+	u[0] = r[1] * f[2] - r[2] * f[1];
+	u[1] = r[2] * f[0] - r[0] * f[2];
+	u[2] = r[0] * f[1] - r[1] * f[0];
+	
+	ahead = f[0] * cam->pos[0] + f[1] * cam->pos[1] + f[2] * cam->pos[2];
+	for (int i = 0; i < 3; ++i)
+	{
+		n[0][i] = f[i]; /* near */
+		n[1][i] = -f[i]; /* far */
+		n[2][i] = tanX * f[i] + r[i]; /* left */
+		n[3][i] = tanX * f[i] - r[i]; /* right */
+		n[4][i] = tanY * f[i] + u[i]; /* bottom */
+		n[5][i] = tanY * f[i] - u[i]; /* top */
+	}
+	
+	for (int k = 0; k < 6; ++k)
+	{
+		memcpy(plane[k], n[k], sizeof(n[k]));
+		plane[k][3] = -(n[k][0] * cam->pos[0] + n[k][1] * cam->pos[1] + n[k][2] * cam->pos[2]);
+	}
+	plane[0][3] = -(ahead + cam->near);
+	plane[1][3] = ahead + cam->far;
+}
+
+/* bounds of a group's own triangles, not its children's */
+static void cull_groupBounds(const struct group *g, float min[3], float max[3])
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		min[k] = INFINITY;
+		max[k] = -INFINITY;
+	}
+	
+	for (const struct triangle *t = g->tri; t; t = t->next)
+	{
+		for (int v = 0; v < 3; ++v)
+		{
+			const float p[3] = { t->v[v].x, t->v[v].y, t->v[v].z };
+			
+			for (int k = 0; k < 3; ++k)
+			{
+				min[k] = fminf(min[k], p[k]);
+				max[k] = fmaxf(max[k], p[k]);
+			}
+		}
+	}
+}
+
+/* false if the box lies entirely outside any plane */
+static bool cull_boxVisible(float plane[6][4], const float min[3], const float max[3])
+{
+	for (int k = 0; k < 6; ++k)
+	{
+		const float *p = plane[k];
+		float x = p[0] >= 0 ? max[0] : min[0];
+		float y = p[1] >= 0 ? max[1] : min[1];
+		float z = p[2] >= 0 ? max[2] : min[2];
+		
+		if (p[0] * x + p[1] * y + p[2] * z + p[3] < 0)
+			return false;
+	}
+	
+	return true;
+}
+#endif // culling simulation
+
+/* automatic division: scores candidate schemes with a cost model */
+#if 1
+#define AUTO_LEVELS_MAX   3
+#define AUTO_CELLS_MAX    12 /* finest cells per axis a candidate may reach */
+#define AUTO_CAMERAS      72 /* 3x3 positions, 8 headings each */
+
+/* rough relative costs of drawing a room, in no particular unit */
+#define AUTO_COST_ENTRY   40 /* cpu bounds test per mesh header entry */
+#define AUTO_COST_GROUP   200 /* G_DL, material setup and pipe sync per drawn group */
+#define AUTO_COST_VTXCMD  30 /* G_VTX dma setup */
+#define AUTO_COST_VTX     15 /* vertex transform and lighting */
+#define AUTO_COST_TRI     25 /* triangle setup */
+
+struct autoCandidate
+{
+	struct room_division div[AUTO_LEVELS_MAX];
+	int divNum;
+	int entries; /* mesh header entries, i.e. groups with triangles */
+	double cost; /* per frame, averaged over the cameras */
+	double groups; /* drawn per frame */
+	double tris;
+	double cmds;
+	double loads;
+};
+
+struct autoJobs
+{
+	struct autoCandidate *cand;
+	int candNum;
+	int next;
+	const struct group *src;
+	float (*plane)[6][4]; /* one frustum per camera */
+	pthread_mutex_t lock;
+};
+
+/* appends every scheme of up to AUTO_LEVELS_MAX levels whose finest
+ * cells stay within AUTO_CELLS_MAX per axis, starting with no division
+ */
+static void auto_candidates(struct buffer *dst, struct autoCandidate c, int cells)
+{
+	buffer_write(dst, &c, sizeof(c));
+	
+	if (c.divNum >= AUTO_LEVELS_MAX)
+		return;
+	
+	for (int d = 2; d * cells <= AUTO_CELLS_MAX; ++d)
+	{
+		struct autoCandidate next = c;
+		
+		next.div[next.divNum++] = (struct room_division){ { d, d, d }, true };
+		auto_candidates(dst, next, d * cells);
+	}
+}
+
+/* scatters cameras through the room at mid height, looking level */
+static void auto_cameras(const struct bbox *bbox, float plane[AUTO_CAMERAS][6][4])
+{
+	int n = 0;
+	
+	for (int x = 0; x < 3; ++x)
+	{
+		for (int z = 0; z < 3; ++z)
+		{
+			for (int h = 0; h < 8; ++h)
+			{
+				struct room_camera cam = { .fovy = 60, .aspect = 4.0f / 3, .near = 10, .far = 12800 };
+				float a = h * 2 * 3.14159265f / 8;
+				
+				cam.pos[0] = bbox->xmin + (bbox->xmax - bbox->xmin) * (x + 0.5f) / 3;
+				cam.pos[1] = (bbox->ymin + bbox->ymax) * 0.5f;
+				cam.pos[2] = bbox->zmin + (bbox->zmax - bbox->zmin) * (z + 0.5f) / 3;
+				cam.target[0] = cam.pos[0] + cosf(a);
+				cam.target[1] = cam.pos[1];
+				cam.target[2] = cam.pos[2] + sinf(a);
+				
+				cull_frustum(&cam, plane[n++]);
+			}
+		}
+	}
+}
+
+/* divides a copy of the room, compiles each group, and adds up
+ * what each camera would draw
+ */
+static void auto_evaluate(struct autoCandidate *c, const struct group *src, float plane[AUTO_CAMERAS][6][4])
+{
+	struct group *g = group_clone(src);
+	struct bbox bbox = group_bounds(g);
+	struct buffer list = {0};
+	struct zroomGroup *group;
+	double sum = 0;
+	
+	group_divide(g, &bbox, c->div, c->divNum);
+	zroomGatherTree(&list, g);
+	group = (struct zroomGroup*)list.data;
+	c->entries = list.len / sizeof(*group);
+	
+	for (int i = 0; i < c->entries; ++i)
+	{
+		struct zroomGroup *zg = &group[i];
+		float min[3];
+		float max[3];
+		double cost;
+		int seen = 0;
+		
+		zroomCompileGroup(zg, true, &sgWriteDefaults);
+		cull_groupBounds(zg->g, min, max);
+		cost = AUTO_COST_GROUP
+			+ zg->cmds * AUTO_COST_VTXCMD
+			+ zg->loads * AUTO_COST_VTX
+			+ zg->triNum * AUTO_COST_TRI
+		;
+		
+		for (int k = 0; k < AUTO_CAMERAS; ++k)
+			seen += cull_boxVisible(plane[k], min, max);
+		
+		sum += cost * seen;
+		c->groups += seen;
+		c->tris += (double)zg->triNum * seen;
+		c->cmds += (double)zg->cmds * seen;
+		c->loads += (double)zg->loads * seen;
+		
+		zroomGroupFree(zg);
+	}
+	
+	c->cost = sum / AUTO_CAMERAS + c->entries * AUTO_COST_ENTRY;
+	c->groups /= AUTO_CAMERAS;
+	c->tris /= AUTO_CAMERAS;
+	c->cmds /= AUTO_CAMERAS;
+	c->loads /= AUTO_CAMERAS;
+	
+	buffer_free(&list);
+	group_free(g);
+}
+
+static void *auto_worker(void *arg)
+{
+	struct autoJobs *jobs = arg;
+	
+	for (;;)
+	{
+		int i;
+		
+		pthread_mutex_lock(&jobs->lock);
+		i = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+		
+		if (i >= jobs->candNum)
+			break;
+		
+		auto_evaluate(&jobs->cand[i], jobs->src, jobs->plane);
+	}
+	
+	return 0;
+}
+
+static int auto_compare(const void *a, const void *b)
+{
+	const struct autoCandidate *x = a;
+	const struct autoCandidate *y = b;
+	
+	/* schemes the mesh header can't hold sort last */
+	if ((x->entries > UINT8_MAX) != (y->entries > UINT8_MAX))
+		return x->entries > UINT8_MAX ? 1 : -1;
+	
+	/* on a tie, prefer fewer entries, then fewer levels */
+	if (x->cost != y->cost)
+		return x->cost > y->cost ? 1 : -1;
+	if (x->entries != y->entries)
+		return x->entries - y->entries;
+	
+	return x->divNum - y->divNum;
+}
+#endif // automatic division
+
+/* wavefront import: chunks of the file are parsed on separate threads,
+ * then their indices are resolved and triangles built the same way
+ */
+#if 1
+#define OBJ_CHUNK_MIN  (1 << 20) /* bytes; smaller files parse on one thread */
+#define OBJ_NONE       INT_MIN /* corner without texcoord or normal */
+
+#define OBJ_RELATIVE_V  (1 << 0) /* objCorner index is relative to the chunk */
+#define OBJ_RELATIVE_VT (1 << 1)
+#define OBJ_RELATIVE_VN (1 << 2)
+
+/* indices from the file, less one; negative (relative) indices are
+ * stored as an index within the chunk, flagged in relative, until the
+ * chunk's base is known (they may point back before the chunk, so
+ * the index within it can be negative)
+ */
+struct objCorner
+{
+	int v;
+	int vt;
+	int vn;
+	int relative;
+};
+
+/* triangles of one run of faces between group statements */
+struct objSegment
+{
+	struct triangle *head;
+	struct triangle **tail;
+	bool newGroup;
+};
+
+struct objChunk
+{
+	const char *begin;
+	const char *end;
+	struct buffer pos; /* float[3] */
+	struct buffer col; /* float[3], alongside pos */
+	struct buffer tex; /* float[2] */
+	struct buffer nrm; /* float[3] */
+	struct buffer corner;
+	struct buffer face; /* int: corners in each polygon */
+	struct buffer groupAt; /* int: face where each group statement appeared */
+	int posBase;
+	int texBase;
+	int nrmBase;
+	struct objSegment *seg;
+	int segNum;
+	int triNum;
+	const char *error; /* first failure, and the line it happened on */
+	const char *errorAt;
+};
+
+struct objImport
+{
+	struct objChunk *chunk;
+	int chunkNum;
+	int next;
+	int pass;
+	float scale;
+	struct material *mat;
+	const float (*pos)[3];
+	const float (*col)[3];
+	const float (*tex)[2];
+	const float (*nrm)[3];
+	int posNum;
+	int texNum;
+	int nrmNum;
+	bool hasColor;
+	pthread_mutex_t lock;
+};
+
+static const char *obj_skip(const char *p)
+{
+	while (*p == ' ' || *p == '\t')
+		++p;
+	
+	return p;
+}
+
+/* returns where the number ends, or 0 if there is none */
+static const char *obj_float(const char *p, float *dst)
+{
+	const char *digits;
+	double v = 0;
+	bool neg = false;
+	
+	p = obj_skip(p);
+	if (*p == '-' || *p == '+')
+		neg = *p++ == '-';
+	
+	digits = p;
+	for ( ; *p >= '0' && *p <= '9'; ++p)
+		v = v * 10 + (*p - '0');
+	if (*p == '.')
+	{
+		double scale = 0.1;
+		
+		for (++p; *p >= '0' && *p <= '9'; ++p, scale *= 0.1)
+			v += (*p - '0') * scale;
+	}
+	if (p == digits || (p == digits + 1 && *digits == '.'))
+		return 0;
+	
+	if (*p == 'e' || *p == 'E')
+	{
+		int e = 0;
+		bool eneg = false;
+		
+		++p;
+		if (*p == '-' || *p == '+')
+			eneg = *p++ == '-';
+		for ( ; *p >= '0' && *p <= '9'; ++p)
+			e = e * 10 + (*p - '0');
+		v *= pow(10, eneg ? -e : e);
+	}
+	
+	*dst = neg ? -v : v;
+	
+	return p;
+}
+
+static const char *obj_int(const char *p, int *dst)
+{
+	const char *digits;
+	int v = 0;
+	bool neg = false;
+	
+	if (*p == '-' || *p == '+')
+		neg = *p++ == '-';
+	
+	for (digits = p; *p >= '0' && *p <= '9'; ++p)
+		v = v * 10 + (*p - '0');
+	if (p == digits)
+		return 0;
+	
+	*dst = neg ? -v : v;
+	
+	return p;
+}
+
+/* one index of a face corner, made zero-based or chunk-relative;
+ * flag is set in *relative for the latter
+ */
+static int obj_index(int idx, int local, int *relative, int flag)
+{
+	if (idx > 0)
+		return idx - 1;
+	
+	*relative |= flag;
+	
+	return local + idx;
+}
+
+/* index of a corner into the whole file, or -1 for none */
+static int obj_resolve(const struct objCorner *k, int idx, int flag, int base)
+{
+	if (idx == OBJ_NONE)
+		return -1;
+	
+	return (k->relative & flag) ? base + idx : idx;
+}
+
+/* first pass: gather a chunk's vertices and faces */
+static void obj_parseChunk(struct objChunk *c)
+{
+	int posNum = 0;
+	int texNum = 0;
+	int nrmNum = 0;
+	
+	for (const char *p = c->begin, *next; p < c->end; p = next)
+	{
+		next = (const char*)memchr(p, '\n', c->end - p) + 1;
+		p = obj_skip(p);
+		
+		if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			float v[6] = { 0, 0, 0, 1, 1, 1 };
+			const char *q = p + 1;
+			int n;
+			
+			for (n = 0; n < 6 && (q = obj_float(q, &v[n])); ++n)
+				;
+			if (n < 3)
+				goto fail;
+			
+			/* a fourth value alone is a weight, not red */
+			if (n < 6)
+				v[3] = v[4] = v[5] = 1;
+			buffer_write(&c->pos, v, sizeof(float[3]));
+			buffer_write(&c->col, v + 3, sizeof(float[3]));
+			posNum += 1;
+		}
+		else if (p[0] == 'v' && p[1] == 't')
+		{
+			float v[2] = {0};
+			
+			if (!obj_float(p + 2, &v[0]))
+				goto fail;
+			obj_float(obj_float(p + 2, &v[0]), &v[1]);
+			buffer_write(&c->tex, v, sizeof(v));
+			texNum += 1;
+		}
+		else if (p[0] == 'v' && p[1] == 'n')
+		{
+			float v[3];
+			const char *q = p + 2;
+			
+			for (int i = 0; i < 3; ++i)
+				if (!(q = obj_float(q, &v[i])))
+					goto fail;
+			buffer_write(&c->nrm, v, sizeof(v));
+			nrmNum += 1;
+		}
+		else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+		{
+			const char *q = obj_skip(p + 1);
+			int num = 0;
+			
+			while (*q && *q != '\n' && *q != '\r')
+			{
+				struct objCorner k = { .vt = OBJ_NONE, .vn = OBJ_NONE };
+				int idx;
+				
+				if (!(q = obj_int(q, &idx)) || !idx)
+					goto fail;
+				k.v = obj_index(idx, posNum, &k.relative, OBJ_RELATIVE_V);
+				
+				if (*q == '/')
+				{
+					if (q[1] != '/')
+					{
+						if (!(q = obj_int(q + 1, &idx)) || !idx)
+							goto fail;
+						k.vt = obj_index(idx, texNum, &k.relative, OBJ_RELATIVE_VT);
+					}
+					else
+						++q;
+					
+					if (*q == '/')
+					{
+						if (!(q = obj_int(q + 1, &idx)) || !idx)
+							goto fail;
+						k.vn = obj_index(idx, nrmNum, &k.relative, OBJ_RELATIVE_VN);
+					}
+				}
+				
+				buffer_write(&c->corner, &k, sizeof(k));
+				num += 1;
+				q = obj_skip(q);
+			}
+			if (num < 3)
+				goto fail;
+			buffer_write(&c->face, &num, sizeof(num));
+		}
+		else if ((p[0] == 'g' || p[0] == 'o') && (p[1] == ' ' || p[1] == '\t' || p[1] == '\n' || p[1] == '\r'))
+		{
+			int at = c->face.len / sizeof(int);
+			
+			buffer_write(&c->groupAt, &at, sizeof(at));
+		}
+		
+		continue;
+	fail:
+		c->error = "malformed statement";
+		c->errorAt = p;
+		return;
+	}
+}
+
+/* second pass: resolve indices and build a chunk's triangles */
+static void obj_buildChunk(struct objImport *im, struct objChunk *c)
+{
+	const struct objCorner *corner = (const struct objCorner*)c->corner.data;
+	const int *face = (const int*)c->face.data;
+	const int *groupAt = (const int*)c->groupAt.data;
+	int faceNum = c->face.len / sizeof(*face);
+	int groupAtNum = c->groupAt.len / sizeof(*groupAt);
+	int seg = 0;
+	
+	c->segNum = groupAtNum + 1;
+	c->seg = calloc(c->segNum, sizeof(*c->seg));
+	for (int i = 0; i < c->segNum; ++i)
+	{
+		c->seg[i].tail = &c->seg[i].head;
+		c->seg[i].newGroup = i > 0;
+	}
+	
+	for (int f = 0; f < faceNum; corner += face[f++])
+	{
+		struct vertex v[3];
+		
+		while (seg < groupAtNum && groupAt[seg] <= f)
+			++seg;
+		
+		for (int i = 0; i < face[f]; ++i)
+		{
+			const struct objCorner *k = &corner[i];
+			struct vertex *dst = &v[i < 2 ? i : 2];
+			int vi = obj_resolve(k, k->v, OBJ_RELATIVE_V, c->posBase);
+			int ti = obj_resolve(k, k->vt, OBJ_RELATIVE_VT, c->texBase);
+			int ni = obj_resolve(k, k->vn, OBJ_RELATIVE_VN, c->nrmBase);
+			uint8_t *o = dst->other;
+			float p[3];
+			
+			if (vi < 0 || vi >= im->posNum
+				|| ti >= im->texNum || (ti < 0 && k->vt != OBJ_NONE)
+				|| ni >= im->nrmNum || (ni < 0 && k->vn != OBJ_NONE)
+			)
+			{
+				c->error = "face index out of range";
+				return;
+			}
+			
+			for (int a = 0; a < 3; ++a)
+			{
+				p[a] = roundf(im->pos[vi][a] * im->scale);
+				if (p[a] < INT16_MIN || p[a] > INT16_MAX)
+				{
+					c->error = "position out of int16 range (try a smaller --scale)";
+					return;
+				}
+			}
+			dst->x = p[0];
+			dst->y = p[1];
+			dst->z = p[2];
+			
+			/* flag, then s and t in 10.5 fixed point on a 32x32 texture */
+			memset(o, 0, sizeof(dst->other));
+			if (ti >= 0)
+			{
+				int s = lrintf(im->tex[ti][0] * 32 * 32);
+				int t = lrintf((1 - im->tex[ti][1]) * 32 * 32);
+				
+				BEw16(o + 2, max_int(INT16_MIN, min_int(INT16_MAX, s)));
+				BEw16(o + 4, max_int(INT16_MIN, min_int(INT16_MAX, t)));
+			}
+			
+			/* normals when lit, otherwise colors */
+			for (int a = 0; a < 3; ++a)
+			{
+				if (ni >= 0)
+					o[6 + a] = (int8_t)lrintf(fmaxf(-1, fminf(1, im->nrm[ni][a])) * 127);
+				else
+					o[6 + a] = lrintf(fmaxf(0, fminf(1, im->col[vi][a])) * 255);
+			}
+			o[9] = 0xff;
+			
+			/* triangulate as a fan */
+			if (i >= 2)
+			{
+				struct triangle *t = calloc(1, sizeof(*t));
+				
+				t->v[0] = v[0];
+				t->v[1] = v[1];
+				t->v[2] = v[2];
+				t->mat = im->mat;
+				c->triNum += 1;
+				*c->seg[seg].tail = t;
+				c->seg[seg].tail = &t->next;
+				v[1] = v[2];
+			}
+		}
+	}
+}
+
+static void *obj_worker(void *arg)
+{
+	struct objImport *im = arg;
+	
+	for (;;)
+	{
+		int i;
+		
+		pthread_mutex_lock(&im->lock);
+		i = im->next++;
+		pthread_mutex_unlock(&im->lock);
+		
+		if (i >= im->chunkNum)
+			break;
+		
+		if (im->pass == 0)
+			obj_parseChunk(&im->chunk[i]);
+		else
+			obj_buildChunk(im, &im->chunk[i]);
+	}
+	
+	return 0;
+}
+
+/* runs one pass over every chunk on up to threadNum threads */
+static void obj_runPass(struct objImport *im, int pass, int threadNum)
+{
+	pthread_t thread[64];
+	
+	im->pass = pass;
+	im->next = 0;
+	threadNum = min_int(threadNum, sizeof(thread) / sizeof(*thread));
+	threadNum = min_int(threadNum, im->chunkNum);
+	
+	if (threadNum <= 1)
+		obj_worker(im);
+	else
+	{
+		/* make do with the threads that could be created */
+		for (int i = 0; i < threadNum; ++i)
+			if (pthread_create(&thread[i], 0, obj_worker, im))
+				threadNum = i;
+		if (!threadNum)
+			obj_worker(im);
+		for (int i = 0; i < threadNum; ++i)
+			pthread_join(thread[i], 0);
+	}
+}
+#endif // wavefront import
+
+/* calls fn(arg), returning false if it dies instead; public functions
+ * run their work through this, leaving what to release in arg, and
+ * room_error() saying why
+ */
+static bool roomTry(void (*fn)(void *arg), void *arg)
+{
+	jmp_buf *prev;
+	jmp_buf env;
+	
+	/* the thread may already be catching, e.g. in --serve */
+	prev = die_catch(&env);
+	if (setjmp(env))
+	{
+		die_catch(prev);
+		return false;
+	}
+	
+	fn(arg);
+	die_catch(prev);
+	
+	return true;
+}
+#endif // private helpers
+
+// public functions
+#if 1
+/* merges all groups into one */
+void room_flatten(struct room *room)
+{
+	struct group *dst;
+	struct group *next = 0;
+	
+	roomOwn(room);
+	if (!room || !(dst = room->group))
+		return;
+	
+	for (struct group *src = dst->next; src; src = next)
+	{
+		next = src->next;
+		group_merge(dst, src);
+	}
+	
+	/* undo any previous division */
+	for (struct group *src = dst->child; src; src = next)
+	{
+		next = src->next;
+		group_merge(dst, src);
+	}
+	
+	dst->next = 0;
+	dst->child = 0;
+}
+
+/* removes triangles that can never produce pixels: zero-area ones,
+ * and exact duplicates of another triangle with the same material
+ */
+void room_cleanup(struct room *room)
+{
+	struct triangle **hash;
+	uint32_t hashCap = 16;
+	int degenerate = 0;
+	int duplicate = 0;
+	int num;
+	
+	if (!room)
+		return;
+	
+	if (room->spill)
+		die("room_cleanup error: room is spilled to disk");
+	
+	roomOwn(room);
+	num = group_countTriangles(room->group);
+	while (hashCap < (uint32_t)num * 2)
+		hashCap *= 2;
+	hash = calloc(hashCap, sizeof(*hash));
+	
+	group_cleanup(room->group, hash, hashCap - 1, &degenerate, &duplicate);
+	Log("cleanup: removed %d degenerate and %d duplicate triangles of %d"
+		, degenerate, duplicate, num
+	);
+	
+	free(hash);
+}
+
+/* divide a flattened room into nested group structure */
+void room_divide(struct room *room, const struct room_division divisions[], const int divisionsNum)
+{
+	struct bbox bbox;
+	
+	if (!room || !divisions || divisionsNum <= 0 || !room->group)
+		return;
+	
+	// TODO: do I want a fatal error here, or just a warning + invoke room_flatten?
+	if (room->group->next)
+		die("room_divide error: trying to divide a non-flattened room");
+	
+	roomOwn(room);
+	bbox = group_bounds(room->group);
+	
+	group_divide(room->group, &bbox, divisions, divisionsNum);
+}
+
+/* merges src into dst (src will be destroyed) */
+void room_merge(struct room *dst, struct room *src)
+{
+	struct material *mNext = 0;
+	struct material **mTail;
+	struct material *dups = 0;
+	struct material **hash;
+	uint32_t hashCap = 16;
+	uint32_t hashMask;
+	int matNum = 0;
+	int merged = 0;
+	
+	if (!dst || !src)
+		return;
+	
+	roomOwn(dst);
+	roomOwn(src);
+	
+	/* table of dst's materials, and of src's as they are appended */
+	for (struct material *m = dst->mat; m; m = m->next)
+		matNum += 1;
+	for (struct material *m = src->mat; m; m = m->next)
+		matNum += 1;
+	while (hashCap < (uint32_t)matNum * 2)
+		hashCap *= 2;
+	hashMask = hashCap - 1;
+	hash = calloc(hashCap, sizeof(*hash));
+	
+	for (mTail = &dst->mat; *mTail; mTail = &(*mTail)->next)
+	{
+		uint32_t h;
+		
+		for (h = (*mTail)->hash & hashMask; hash[h]; h = (h + 1) & hashMask)
+			;
+		hash[h] = *mTail;
+	}
+	
+	/* append src's materials, unifying those dst already has */
+	for (struct material *m = src->mat; m; m = mNext)
+	{
+		uint32_t h;
+		
+		mNext = m->next;
+		m->next = 0;
+		
+		for (h = m->hash & hashMask; hash[h]; h = (h + 1) & hashMask)
+		{
+			struct material *d = hash[h];
+			
+			if (d->hash == m->hash
+				&& d->dataLen == m->dataLen
+				&& !memcmp(d->data, m->data, m->dataLen)
+			)
+			{
+				m->mergedInto = d;
+				merged += 1;
+				break;
+			}
+		}
+		
+		if (m->mergedInto)
+		{
+			m->next = dups;
+			dups = m;
+			continue;
+		}
+		
+		hash[h] = m;
+		*mTail = m;
+		mTail = &m->next;
+	}
+	group_remapMaterials(src->group);
+	free(hash);
+	if (merged)
+		Log("merged %d duplicate materials", merged);
+	
+	for (struct group *g = dst->group; g; g = g->next)
+	{
+		if (!g->next)
+		{
+			g->next = src->group;
+			break;
+		}
+	}
+	if (!dst->group)
+		dst->group = src->group;
+	
+	/* move src's resident triangles to disk alongside dst's */
+	if (src->spill || dst->spill)
+	{
+		src->group = 0;
+		room_spill(dst);
+		
+		if (src->spill)
+		{
+			struct triangle t;
+			
+			rewind(src->spill);
+			while (fread(&t, 1, sizeof(t), src->spill) == sizeof(t))
+			{
+				if (t.mat && t.mat->mergedInto)
+					t.mat = t.mat->mergedInto;
+				fwrite(&t, 1, sizeof(t), dst->spill);
+			}
+			fclose(src->spill);
+			
+			dst->spillNum += src->spillNum;
+			dst->spillBounds.xmin = min_int(dst->spillBounds.xmin, src->spillBounds.xmin);
+			dst->spillBounds.ymin = min_int(dst->spillBounds.ymin, src->spillBounds.ymin);
+			dst->spillBounds.zmin = min_int(dst->spillBounds.zmin, src->spillBounds.zmin);
+			dst->spillBounds.xmax = max_int(dst->spillBounds.xmax, src->spillBounds.xmax);
+			dst->spillBounds.ymax = max_int(dst->spillBounds.ymax, src->spillBounds.ymax);
+			dst->spillBounds.zmax = max_int(dst->spillBounds.zmax, src->spillBounds.zmax);
+		}
+	}
+	
+	/* duplicates are no longer referenced */
+	for (struct material *m = dups; m; m = mNext)
+	{
+		mNext = m->next;
+		
+		free(m->data);
+		free(m);
+	}
+	
+	free(src);
+}
+
+/* what one display list draws, including the lists it calls */
+struct infoDL
+{
+	uint32_t addr;
+	int vtxCmds;
+	int vtxLoaded;
+	int tris;
+	bool scanned; /* false while it is still being scanned */
+};
+
+/* room_info's progress through a room's display lists */
+struct infoScan
+{
+	struct segment seg;
+	struct room_info *info;
+	const char *fn;
+	uint8_t *data; /* the file, decompressed if need be */
+	struct buffer dl; /* struct infoDL for each list already scanned */
+	struct buffer mat; /* uint32_t hashes of material setups seen */
+	uint8_t *vtxSeen; /* one bit per 16 bytes of the segment */
+};
+
+/* counts a run of material setup commands, once per distinct run */
+static void infoScanMaterial(struct infoScan *s, const uint8_t *start, const uint8_t *end)
+{
+	uint32_t hash = fnv1a32(start, end - start);
+	const uint32_t *seen = (const uint32_t*)s->mat.data;
+	
+	for (size_t i = 0; i < s->mat.len / sizeof(*seen); ++i)
+		if (seen[i] == hash)
+			return;
+	
+	buffer_write(&s->mat, &hash, sizeof(hash));
+	s->info->materials += 1;
+}
+
+/* like decodeDL, but only counts what it finds; a list is scanned
+ * once, and what it draws is added again each time it is called
+ */
+static void infoScanDL(struct infoScan *s, const uint32_t addr, const int depth)
+{
+	const struct segment *seg = &s->seg;
+	const struct infoDL *seen = (const struct infoDL*)s->dl.data;
+	const uint8_t *src = segmentRangeV(seg, addr, 8);
+	const uint8_t *end = seg->data + seg->len;
+	const uint8_t *matStart = 0;
+	struct room_info *info = s->info;
+	struct infoDL this = { .addr = addr };
+	struct infoDL *dl;
+	size_t thisAt = s->dl.len;
+	
+	if (!src)
+		die("display list %08x lies outside the room", addr);
+	if (depth >= DL_DEPTH_MAX)
+		die("display list %08x nested too deeply", addr);
+	
+	for (size_t i = 0; i < s->dl.len / sizeof(*seen); ++i)
+	{
+		/* a list calling itself adds nothing more */
+		if (seen[i].addr == addr && !seen[i].scanned)
+			return;
+		if (seen[i].addr == addr)
+		{
+			info->vtxCmds += seen[i].vtxCmds;
+			info->vtxLoaded += seen[i].vtxLoaded;
+			info->tris += seen[i].tris;
+			return;
+		}
+	}
+	
+	/* counts are kept as totals before, until the list is done */
+	this.vtxCmds = info->vtxCmds;
+	this.vtxLoaded = info->vtxLoaded;
+	this.tris = info->tris;
+	buffer_write(&s->dl, &this, sizeof(this));
+	info->dlNum += 1;
+	
+	for ( ; src + 8 <= end; src += 8)
+	{
+		enum dlOp op = sgDlOp[*src];
+		
+		info->dlBytes += 8;
+		
+		/* culling isn't material setup */
+		if (*src == G_CULLDL)
+			continue;
+		
+		if (matStart
+			&& op != DLOP_MATERIAL
+			&& !(op == DLOP_DL && src[4] != 0x03)
+		)
+		{
+			infoScanMaterial(s, matStart, src);
+			matStart = 0;
+		}
+		
+		switch (op)
+		{
+			case DLOP_MATERIAL:
+				if (!matStart)
+					matStart = src;
+				break;
+			
+			case DLOP_VTX:
+			{
+				int numv = (src[1] << 4) | (src[2] >> 4);
+				uint32_t vaddr = BEr32(src + 4);
+				const uint8_t *v = segmentRangeV(seg, vaddr, numv * 16);
+				
+				if (!v)
+					die("G_VTX at %08x reads outside the room"
+						, 0x03000000 | (unsigned)(src - seg->data)
+					);
+				
+				info->vtxCmds += 1;
+				info->vtxLoaded += numv;
+				for (int k = 0; k < numv; ++k, v += 16)
+				{
+					size_t slot = (v - seg->data) / 16;
+					int16_t p[3] = { BEr16(v), BEr16(v + 2), BEr16(v + 4) };
+					
+					if (!(s->vtxSeen[slot / 8] & (1 << (slot % 8))))
+					{
+						s->vtxSeen[slot / 8] |= 1 << (slot % 8);
+						info->vtxUnique += 1;
+					}
+					
+					for (int a = 0; a < 3; ++a)
+					{
+						info->min[a] = min_int(info->min[a], p[a]);
+						info->max[a] = max_int(info->max[a], p[a]);
+					}
+				}
+				break;
+			}
+			
+			case DLOP_TRI:
+				info->tris += 1;
+				break;
+			
+			case DLOP_TRI2:
+				info->tris += 2;
+				break;
+			
+			case DLOP_DL:
+				if (src[4] != 0x03)
+				{
+					if (!matStart)
+						matStart = src;
+					break;
+				}
+				infoScanDL(s, BEr32(src + 4), depth + 1);
+				if (src[1])
+					goto done;
+				break;
+			
+			case DLOP_ENDDL:
+				if (matStart)
+					infoScanMaterial(s, matStart, src);
+				goto done;
+		}
+	}
+	
+	die("display list %08x runs past the end of the room", addr);
+	
+done:
+	dl = (struct infoDL*)(s->dl.data + thisAt);
+	dl->vtxCmds = info->vtxCmds - dl->vtxCmds;
+	dl->vtxLoaded = info->vtxLoaded - dl->vtxLoaded;
+	dl->tris = info->tris - dl->tris;
+	dl->scanned = true;
+}
+
+/* if data is Yaz0, decodes it to a new buffer and updates len;
+ * returns 0 if data is not compressed
+ */
+static uint8_t *roomDecompress(const uint8_t *data, size_t *len, const char *fn)
+{
+	size_t rawLen = yaz0_size(data, *len);
+	double traceStart = trace_now();
+	uint8_t *raw;
+	
+	if (!rawLen)
+		return 0;
+	
+	if (!(raw = malloc(rawLen))
+		|| !yaz0_decode(raw, rawLen, data, *len)
+	)
+	{
+		free(raw);
+		die("failed to decompress Yaz0 room '%s'", fn);
+	}
+	*len = rawLen;
+	
+	trace_span("yaz0", traceStart, fn);
+	
+	return raw;
+}
+
+/* loads a room from memory into room, which the caller owns and
+ * frees even if this dies partway; fn names it in messages
+ */
+static void roomParse(struct room *room, const uint8_t *data, const size_t len, const char *fn)
+{
+	struct segment segment = { .data = data, .len = len };
+	struct segment *seg = &segment;
+	const uint8_t *meshHeader = 0;
+	
+	/* find mesh header */
+	for (size_t i = 0; i + 8 <= len && data[i] != 0x14; i += 8)
+		if (data[i] == 0x0A)
+			meshHeader = segmentRangeV(seg, BEr32(data + i + 4), 12);
+	if (!meshHeader)
+		die("failed to locate mesh header in room '%s'", fn);
+	
+	/* parse mesh header */
+	{
+		double traceStart = trace_now();
+		const uint8_t *s = segmentReadP(seg, meshHeader + 4);
+		const uint8_t *e = segmentReadP(seg, meshHeader + 8);
+		/* types 0 and 2 list opa and xlu display lists per entry */
+		const int stride = *meshHeader == 0x00 ? 8 : 16;
+		const int dlAt = *meshHeader == 0x00 ? 0 : 8;
+		uint8_t num = meshHeader[1];
+		
+		if (*meshHeader != 0x00 && *meshHeader != 0x02)
+			die("only mesh header types 0x00 and 0x02 supported; '%s' type is %02x'"
+				, fn, *meshHeader
+			);
+		
+		/* unnecessary sanity check */
+		if (!s || !e || e < s || (e - s) / stride != num
+			|| !segmentRangeV(seg, BEr32(meshHeader + 4), num * stride)
+		)
+			die("mesh header sanity check failed");
+		
+		while (s < e)
+		{
+			appendDL(seg, room, BEr32(s + dlAt));
+			appendDL(seg, room, BEr32(s + dlAt + 4));
+			
+			s += stride;
+		}
+		
+		trace_span("mesh header", traceStart, fn);
+	}
+	
+	if (seg->unfollowedDL)
+		Log("'%s': %d display list branches into other segments were not followed"
+			, fn, seg->unfollowedDL
+		);
+}
+
+/* a room being loaded, and what it holds until it is done */
+struct roomLoad
+{
+	const char *fn; /* 0 when loading from memory */
+	const uint8_t *data;
+	size_t len;
+	uint8_t *copy; /* of the file, or decompressed; freed when done */
+	float scale; /* for obj files */
+	struct room *room;
+};
+
+static void roomLoadRun(void *arg)
+{
+	struct roomLoad *l = arg;
+	const char *name = l->fn ? l->fn : "(memory)";
+	uint8_t *raw;
+	
+	if (l->fn && !(l->data = l->copy = loadfile(l->fn, &l->len)))
+		die("failed to load room file '%s'", l->fn);
+	if (!l->data || !l->len)
+		die("no room data given");
+	
+	/* decoded straight into the buffer the room is parsed from */
+	if ((raw = roomDecompress(l->data, &l->len, name)))
+	{
+		free(l->copy);
+		l->data = l->copy = raw;
+	}
+	
+	l->room = calloc(1, sizeof(*l->room));
+	roomParse(l->room, l->data, l->len, name);
+}
+
+/* loads a room; returns 0 if it can't, and room_error() says why */
+struct room *room_load(const char *fn)
+{
+	struct roomLoad l = { .fn = fn };
+	
+	if (!roomTry(roomLoadRun, &l))
+	{
+		room_free(l.room);
+		l.room = 0;
+	}
+	free(l.copy);
+	
+	return l.room;
+}
+
+/* room_info's work; what it allocates is left in s to be freed */
+static void infoScanRoom(void *arg)
+{
+	struct infoScan *s = arg;
+	struct room_info *info = s->info;
+	const struct segment *seg = &s->seg;
+	const char *fn = s->fn;
+	size_t len = 0;
+	uint8_t *data;
+	const uint8_t *meshHeader = 0;
+	uint8_t *raw;
+	
+	if (!(data = s->data = loadfile(fn, &len)))
+		die("failed to load room file '%s'", fn);
+	
+	if ((raw = roomDecompress(data, &len, fn)))
+	{
+		free(data);
+		data = s->data = raw;
+	}
+	
+	memset(info, 0, sizeof(*info));
+	for (int a = 0; a < 3; ++a)
+	{
+		info->min[a] = INT16_MAX;
+		info->max[a] = INT16_MIN;
+	}
+	
+	s->seg.data = data;
+	s->seg.len = len;
+	
+	for (size_t i = 0; i + 8 <= len && data[i] != 0x14; i += 8)
+		if (data[i] == 0x0A)
+			meshHeader = segmentRangeV(seg, BEr32(data + i + 4), 12);
+	if (!meshHeader)
+		die("failed to locate mesh header in room '%s'", fn);
+	
+	info->meshType = meshHeader[0];
+	info->entries = meshHeader[1];
+	
+	/* types 0 and 2 list opa and xlu display lists per entry */
+	if (info->meshType == 0x00 || info->meshType == 0x02)
+	{
+		const int stride = info->meshType == 0x00 ? 8 : 16;
+		const int dlAt = info->meshType == 0x00 ? 0 : 8;
+		const uint8_t *e = segmentRangeV(seg, BEr32(meshHeader + 4), info->entries * stride);
+		
+		if (!e)
+			die("mesh header entries of '%s' lie outside the room", fn);
+		
+		s->vtxSeen = calloc(len / 16 / 8 + 1, 1);
+		for (int i = 0; i < info->entries; ++i, e += stride)
+		{
+			for (int k = 0; k < 2; ++k)
+			{
+				uint32_t addr = BEr32(e + dlAt + k * 4);
+				
+				if (addr >> 24 == 0x03)
+					infoScanDL(s, addr, 0);
+			}
+		}
+	}
+}
+
+/* summarizes a room file from its headers and display lists,
+ * without building triangles; false if it can't, see room_error()
+ */
+bool room_info(const char *fn, struct room_info *info)
+{
+	struct infoScan scan = { .info = info, .fn = fn };
+	bool ok = roomTry(infoScanRoom, &scan);
+	
+	free(scan.vtxSeen);
+	buffer_free(&scan.dl);
+	buffer_free(&scan.mat);
+	free(scan.data);
+	
+	return ok;
+}
+
+
+/* loads a room already in memory; data is not retained */
+struct room *room_loadFromMemory(const void *data, const size_t len)
+{
+	struct roomLoad l = { .data = data, .len = len };
+	
+	if (!roomTry(roomLoadRun, &l))
+	{
+		room_free(l.room);
+		l.room = 0;
+	}
+	free(l.copy);
+	
+	return l.room;
+}
+
+/* a file in a rom's dma table, and the room decoded from it */
+struct romFile
+{
+	int index;
+	uint32_t vromStart;
+	uint32_t vromEnd;
+	uint32_t romStart;
+	uint32_t romEnd; /* 0 = stored uncompressed */
+	char name[32];
+	struct room *room;
+};
+
+struct romJobs
+{
+	const uint8_t *rom;
+	size_t romLen;
+	struct romFile *file;
+	int fileNum;
+	int next;
+	bool threaded;
+	pthread_mutex_t lock;
+};
+
+/* finds the dma table by its first two entries, which describe
+ * the rom header and boot code; returns its offset or 0
+ */
+static size_t romFindDmaTable(const uint8_t *rom, const size_t romLen)
+{
+	for (size_t i = 0x1060; i + 32 <= romLen; i += 16)
+		if (BEr32(rom + i) == 0
+			&& BEr32(rom + i + 4) == 0x1060
+			&& BEr32(rom + i + 8) == 0
+			&& BEr32(rom + i + 12) == 0
+			&& BEr32(rom + i + 16) == 0x1060
+			&& BEr32(rom + i + 24) == 0x1060
+		)
+			return i;
+	
+	return 0;
+}
+
+/* whether a file looks like a room roomParse can load: a short header
+ * ending in 0x14, with a mesh header (0x0A) of type 0 or 2 and no
+ * room list (0x04, which only scenes have)
+ */
+static bool romIsRoom(const uint8_t *data, const size_t len)
+{
+	struct segment segment = { .data = data, .len = len };
+	const struct segment *seg = &segment;
+	const uint8_t *meshHeader = 0;
+	const uint8_t *s;
+	const uint8_t *e;
+	size_t i;
+	
+	for (i = 0; i + 8 <= len && data[i] != 0x14; i += 8)
+	{
+		if (data[i] > 0x1e || data[i] == 0x04 || i >= 32 * 8)
+			return false;
+		if (data[i] == 0x0A)
+			meshHeader = segmentRangeV(seg, BEr32(data + i + 4), 12);
+	}
+	
+	if (i + 8 > len || !meshHeader
+		|| (*meshHeader != 0x00 && *meshHeader != 0x02)
+	)
+		return false;
+	
+	s = segmentReadP(seg, meshHeader + 4);
+	e = segmentReadP(seg, meshHeader + 8);
+	
+	return s && e && e >= s
+		&& (e - s) / (*meshHeader == 0x00 ? 8 : 16) == meshHeader[1]
+	;
+}
+
+/* decodes one file straight from the mapping, leaving its room unset
+ * if it isn't one; *raw holds the decompressed copy, if any
+ */
+static void romDecodeFile(const uint8_t *rom, struct romFile *f, uint8_t *volatile *raw)
+{
+	const uint8_t *data = rom + f->romStart;
+	size_t len = f->vromEnd - f->vromStart;
+	
+	if (f->romEnd)
+	{
+		len = f->romEnd - f->romStart;
+		if (!(*raw = roomDecompress(data, &len, f->name)))
+			return;
+		data = *raw;
+	}
+	
+	if (romIsRoom(data, len))
+	{
+		f->room = calloc(1, sizeof(*f->room));
+		roomParse(f->room, data, len, f->name);
+	}
+}
+
+/* romDecodeFile, logging and skipping a file that fails to decode;
+ * every room has its own segment, and die() is caught per thread,
+ * so any number of these may run at once
+ */
+static void romDecodeFileCaught(const uint8_t *rom, struct romFile *f)
+{
+	uint8_t *volatile raw = 0;
+	jmp_buf *prev;
+	jmp_buf env;
+	
+	/* the thread may already be catching, e.g. in --serve */
+	prev = die_catch(&env);
+	if (setjmp(env))
+	{
+		Log("skipping %s: %s", f->name, die_message());
+		room_free(f->room);
+		f->room = 0;
+	}
+	else
+		romDecodeFile(rom, f, &raw);
+	die_catch(prev);
+	
+	free(raw);
+}
+
+static void *romWorker(void *arg)
+{
+	struct romJobs *jobs = arg;
+	
+	if (jobs->threaded)
+		trace_threadName("rom worker");
+	
+	for (;;)
+	{
+		int i;
+		
+		pthread_mutex_lock(&jobs->lock);
+		i = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+		
+		if (i >= jobs->fileNum)
+			break;
+		
+		romDecodeFileCaught(jobs->rom, &jobs->file[i]);
+	}
+	
+	return 0;
+}
+
+/* a rom being loaded by room_loadRom, and what it holds */
+struct romLoad
+{
+	const char *fn;
+	const int *which;
+	int whichNum;
+	struct romJobs jobs; /* rom is mapped while this is nonzero */
+	struct buffer files;
+	struct room *room;
+};
+
+static void romLoadRun(void *arg)
+{
+	struct romLoad *l = arg;
+	struct romJobs *jobs = &l->jobs;
+	const char *fn = l->fn;
+	const int *which = l->which;
+	const int whichNum = l->whichNum;
+	pthread_t thread[64];
+	int threadNum = sgThreads;
+	const uint8_t *rom = 0;
+	struct stat st;
+	size_t dma;
+	int roomNum = 0;
+	int fd;
+	
+	if ((fd = open(fn, O_RDONLY)) < 0
+		|| fstat(fd, &st)
+		|| st.st_size < 0x1060 + 32
+		|| (rom = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED
+	)
+	{
+		if (fd >= 0)
+			close(fd);
+		die("failed to map rom '%s'", fn);
+	}
+	close(fd);
+	
+	jobs->rom = rom;
+	jobs->romLen = st.st_size;
+	
+	if (BEr32(rom) != 0x80371240)
+		die("'%s' is not a big-endian (.z64) rom", fn);
+	if (!(dma = romFindDmaTable(rom, jobs->romLen)))
+		die("failed to locate dma table in rom '%s'", fn);
+	
+	/* gather files, skipping ones left out of the rom */
+	for (int i = 0; dma + i * 16 + 16 <= jobs->romLen; ++i)
+	{
+		const uint8_t *e = rom + dma + i * 16;
+		struct romFile f = {
+			.index = i
+			, .vromStart = BEr32(e)
+			, .vromEnd = BEr32(e + 4)
+			, .romStart = BEr32(e + 8)
+			, .romEnd = BEr32(e + 12)
+		};
+		bool wanted = !whichNum;
+		
+		if (!f.vromEnd)
+			break;
+		
+		for (int k = 0; k < whichNum; ++k)
+			if (which[k] == i)
+				wanted = true;
+		if (!wanted || f.romStart == 0xffffffff)
+			continue;
+		
+		if (f.vromEnd < f.vromStart
+			|| f.romStart > jobs->romLen
+			|| (f.romEnd ? f.romEnd < f.romStart || f.romEnd > jobs->romLen
+				: f.vromEnd - f.vromStart > jobs->romLen - f.romStart)
+		)
+			die("dma table entry %d of rom '%s' lies outside the rom", i, fn);
+		
+		snprintf(f.name, sizeof(f.name), "rom file %d", i);
+		buffer_write(&l->files, &f, sizeof(f));
+	}
+	jobs->file = (struct romFile*)l->files.data;
+	jobs->fileNum = l->files.len / sizeof(*jobs->file);
+	
+	if (threadNum <= 0)
+		threadNum = sysconf(_SC_NPROCESSORS_ONLN);
+	threadNum = min_int(threadNum, sizeof(thread) / sizeof(*thread));
+	threadNum = min_int(threadNum, jobs->fileNum);
+	
+	/* decode */
+	pthread_mutex_init(&jobs->lock, 0);
+	if (threadNum <= 1)
+		romWorker(jobs);
+	else
+	{
+		/* make do with the threads that could be created */
+		jobs->threaded = true;
+		for (int i = 0; i < threadNum; ++i)
+			if (pthread_create(&thread[i], 0, romWorker, jobs))
+				threadNum = i;
+		if (!threadNum)
+		{
+			jobs->threaded = false;
+			romWorker(jobs);
+		}
+		for (int i = 0; i < threadNum; ++i)
+			pthread_join(thread[i], 0);
+	}
+	pthread_mutex_destroy(&jobs->lock);
+	
+	/* check everything asked for decoded, before merging any of it */
+	for (int i = 0; i < jobs->fileNum; ++i)
+	{
+		struct romFile *f = &jobs->file[i];
+		
+		if (f->room)
+			roomNum += 1;
+		else if (whichNum)
+			die("%s of rom '%s' is not a room, or failed to decode", f->name, fn);
+	}
+	
+	for (int k = 0; k < whichNum; ++k)
+	{
+		bool found = false;
+		
+		for (int i = 0; i < jobs->fileNum; ++i)
+			found |= jobs->file[i].index == which[k];
+		if (!found)
+			die("rom '%s' has no file %d", fn, which[k]);
+	}
+	
+	if (!roomNum)
+		die("no rooms found in rom '%s'", fn);
+	
+	/* concatenate */
+	for (int i = 0; i < jobs->fileNum; ++i)
+	{
+		struct romFile *f = &jobs->file[i];
+		
+		if (!f->room)
+			continue;
+		
+		if (l->room)
+			room_merge(l->room, f->room);
+		else
+			l->room = f->room;
+		f->room = 0;
+	}
+	
+	Log("'%s': %d rooms from %d files", fn, roomNum, jobs->fileNum);
+}
+
+/* loads rooms straight out of a rom image, decoding them across threads
+ * and concatenating them in dma table order; which lists the dma table
+ * indices of the files to load, or every room is loaded if whichNum is 0;
+ * returns 0 if the rom can't be loaded, and room_error() says why
+ */
+struct room *room_loadRom(const char *fn, const int *which, const int whichNum)
+{
+	struct romLoad l = { .fn = fn, .which = which, .whichNum = whichNum };
+	
+	if (!roomTry(romLoadRun, &l))
+	{
+		for (int i = 0; i < l.jobs.fileNum; ++i)
+			room_free(l.jobs.file[i].room);
+		room_free(l.room);
+		l.room = 0;
+	}
+	
+	if (l.jobs.rom)
+		munmap((void*)l.jobs.rom, l.jobs.romLen);
+	buffer_free(&l.files);
+	
+	return l.room;
+}
+
+/* why the calling thread's most recent load or write failed */
+const char *room_error(void)
+{
+	return die_message();
+}
+
+/* cleanup */
+void room_free(struct room *room)
+{
+	struct material *mNext = 0;
+	
+	if (!room)
+		return;
+	
+	/* storage still used by another room */
+	if (room->shares && --*room->shares)
+	{
+		free(room);
+		return;
+	}
+	free(room->shares);
+	
+	group_free(room->group);
+	
+	if (room->spill)
+		fclose(room->spill);
+		
+	for (struct material *m = room->mat; m; m = mNext)
+	{
+		mNext = m->next;
+		
+		if (m->data)
+			free(m->data);
+		
+		free(m);
+	}
+	
+	free(room);
+}
+
+/* returns a room sharing everything with this one; whichever of them
+ * is modified first copies the storage for itself, so a snapshot costs
+ * nothing until then (writing a room only touches scratch fields, and
+ * doesn't count as modifying it)
+ */
+struct room *room_snapshot(struct room *room)
+{
+	struct room *snap;
+	
+	if (!room)
+		return 0;
+	
+	if (room->spill)
+		die("room_snapshot error: room is spilled to disk");
+	
+	if (!room->shares)
+	{
+		room->shares = malloc(sizeof(*room->shares));
+		*room->shares = 1;
+	}
+	*room->shares += 1;
+	
+	snap = Memdup(room, sizeof(*room));
+	
+	return snap;
+}
+
+/* a wavefront file being written by room_writeWavefront */
+struct wavefrontFile
+{
+	struct room *room;
+	struct group *group;
+	const char *outfn;
+};
+
+static void wavefrontFileRun(void *arg)
+{
+	struct wavefrontFile *f = arg;
+	struct wavefrontWriter w = { .write = writeFile, .v = 1 };
+	
+	if (!f->room)
+		die("no room to write");
+	if (!(w.udata = fopen(f->outfn, "wb")))
+		die("failed to open '%s'", f->outfn);
+	
+	wavefrontWriteGroups(&w, f->group ? f->group : f->room->group);
+	
+	if (fclose(w.udata))
+		die("failed to write '%s'", f->outfn);
+}
+
+/* write a room to wavefront; false if that fails, see room_error() */
+bool room_writeWavefront(struct room *room, struct group *group, const char *outfn)
+{
+	struct wavefrontFile f = { .room = room, .group = group, .outfn = outfn };
+	
+	return roomTry(wavefrontFileRun, &f);
+}
+
+/* write a room to wavefront, handing the text to write() as it goes */
+void room_writeWavefrontToCallback(struct room *room, room_writeFunc write, void *udata)
+{
+	struct wavefrontWriter w = { .write = write, .udata = udata, .v = 1 };
+	
+	if (!room || !write)
+		return;
+	
+	wavefrontWriteGroups(&w, room->group);
+}
+
+/* write a room to wavefront in a heap buffer; caller frees it */
+void *room_writeWavefrontToMemory(struct room *room, size_t *len)
+{
+	struct buffer b = {0};
+	
+	if (!room || !len)
+		return 0;
+	
+	room_writeWavefrontToCallback(room, writeBuffer, &b);
+	*len = b.len;
+	
+	return b.data;
+}
+
+/* moves every resident triangle of a room to disk */
+void room_spill(struct room *room)
+{
+	struct group *stack = 0;
+	
+	if (!room)
+		return;
+	
+	roomOwn(room);
+	if (!room->spill)
+	{
+		if (!(room->spill = tmpfile()))
+			die("failed to create tmpfile");
+		room->spillBounds = BBOX_INIT_V;
+	}
+	
+	/* walk the group tree, writing and freeing as we go */
+	stack = room->group;
+	room->group = 0;
+	while (stack)
+	{
+		struct group *g = stack;
+		struct triangle *tNext = 0;
+		struct bbox bb;
+		
+		/* group_bounds descends into children, so unlink them first */
+		stack = g->next;
+		if (g->child)
+		{
+			struct group *c = g->child;
+			
+			while (c->next)
+				c = c->next;
+			c->next = stack;
+			stack = g->child;
+			g->child = 0;
+		}
+		bb = group_bounds(g);
+		
+		for (struct triangle *t = g->tri; t; t = tNext)
+		{
+			tNext = t->next;
+			fwrite(t, 1, sizeof(*t), room->spill);
+			room->spillNum += 1;
+			free(t);
+		}
+		
+		room->spillBounds.xmin = min_int(room->spillBounds.xmin, bb.xmin);
+		room->spillBounds.ymin = min_int(room->spillBounds.ymin, bb.ymin);
+		room->spillBounds.zmin = min_int(room->spillBounds.zmin, bb.zmin);
+		room->spillBounds.xmax = max_int(room->spillBounds.xmax, bb.xmax);
+		room->spillBounds.ymax = max_int(room->spillBounds.ymax, bb.ymax);
+		room->spillBounds.zmax = max_int(room->spillBounds.zmax, bb.zmax);
+		
+		free(g);
+	}
+}
+
+/* a zroom file being written by one of the functions below */
+struct zroomWrite
+{
+	struct zroomWriter w;
+	struct room *room;
+	const char *outfn; /* 0 = keep the whole file in w.out */
+	bool withMaterials;
+	const struct room_writeOptions *opt;
+	struct group *group; /* what to write, unless streaming */
+	const struct room_division *divisions; /* streaming */
+	int divisionsNum;
+	long budgetTris; /* nonzero when streaming */
+};
+
+static void zroomWriteRun(void *arg)
+{
+	struct zroomWrite *z = arg;
+	FILE *fp = 0;
+	
+	if (!z->room)
+		die("no room to write");
+	if (z->outfn && !(fp = fopen(z->outfn, "wb")))
+		die("failed to open '%s'", z->outfn);
+	
+	zroomBegin(&z->w, z->room, fp, z->withMaterials, z->opt);
+	if (z->budgetTris)
+	{
+		room_spill(z->room);
+		stream_cell(&z->w, z->room->spill, z->room->spillNum, z->room->spillBounds
+			, z->divisions, z->divisionsNum, z->budgetTris
+		);
+	}
+	else
+		zroomWriteTree(&z->w, z->group);
+	zroomEnd(&z->w);
+}
+
+/* writes z, returning false (with everything released) if that fails */
+static bool zroomWriteCaught(struct zroomWrite *z)
+{
+	if (roomTry(zroomWriteRun, z))
+		return true;
+	
+	zroomAbandon(&z->w);
+	
+	return false;
+}
+
+/* divides and writes a spilled room to zroom format, keeping at most
+ * budget bytes of triangles in memory at any time
+ */
+bool room_writeZroomStreaming(struct room *room, const char *outfn, bool withMaterials, const struct room_writeOptions *opt, const struct room_division divisions[], const int divisionsNum, const size_t budget)
+{
+	struct zroomWrite z = {
+		.room = room
+		, .outfn = outfn
+		, .withMaterials = withMaterials
+		, .opt = opt
+		, .divisions = divisions
+		, .divisionsNum = divisionsNum
+		, .budgetTris = budget / sizeof(struct triangle)
+	};
+	
+	if (z.budgetTris < 1)
+		z.budgetTris = 1;
+	
+	return zroomWriteCaught(&z);
+}
+
+/* writes a reduced-detail copy of a room to zroom format; each group
+ * is simplified on its own, keeping ratio of its triangles, or fewer
+ * if maxError (in world units, 0 = unbounded) allows; material and
+ * cell borders are kept intact, and the room itself is not modified
+ */
+bool room_writeZroomLod(struct room *room, const char *outfn, bool withMaterials, const struct room_writeOptions *opt, float ratio, float maxError)
+{
+	struct zroomWrite z = { .room = room, .outfn = outfn, .withMaterials = withMaterials, .opt = opt };
+	int before = 0;
+	int after = 0;
+	bool ok;
+	
+	if (room)
+	{
+		z.group = group_clone(room->group);
+		group_simplifyTree(z.group, ratio, maxError, &before, &after);
+		Log("lod: reduced %d triangles to %d", before, after);
+	}
+	
+	ok = zroomWriteCaught(&z);
+	group_free(z.group);
+	
+	return ok;
+}
+
+/* how many threads loading, dividing and building bvhs use, and
+ * zroom output unless its options say otherwise; 0 = one per cpu
+ */
+void room_setThreads(int threads)
+{
+	sgThreads = threads;
+}
+
+/* write a room to zroom format; false if that fails, see room_error() */
+bool room_writeZroom(struct room *room, const char *outfn, bool withMaterials, const struct room_writeOptions *opt)
+{
+	struct zroomWrite z = { .room = room, .outfn = outfn, .withMaterials = withMaterials, .opt = opt };
+	
+	if (room)
+		z.group = room->group;
+	
+	return zroomWriteCaught(&z);
+}
+
+/* write a room to zroom format in a heap buffer; caller frees it;
+ * returns 0 if that fails, see room_error()
+ */
+void *room_writeZroomToMemory(struct room *room, bool withMaterials, const struct room_writeOptions *opt, size_t *len)
+{
+	struct zroomWrite z = { .room = room, .withMaterials = withMaterials, .opt = opt };
+	
+	if (!len)
+		return 0;
+	
+	if (room)
+		z.group = room->group;
+	
+	if (!zroomWriteCaught(&z))
+		return 0;
+	
+	*len = z.w.out.len;
+	
+	return z.w.out.data;
+}
+
+/* write a room to zroom format, handing the result to write();
+ * the room header is patched last, so the file is assembled
+ * in memory before write() sees any of it; false if writing
+ * fails or write() comes up short
+ */
+bool room_writeZroomToCallback(struct room *room, bool withMaterials, const struct room_writeOptions *opt, room_writeFunc write, void *udata)
+{
+	size_t len;
+	void *data;
+	bool ok;
+	
+	if (!write
+		|| !(data = room_writeZroomToMemory(room, withMaterials, opt, &len))
+	)
+		return false;
+	
+	if (!(ok = write(udata, data, len) == len))
+		Log("room_writeZroomToCallback: write() was short");
+	
+	free(data);
+	
+	return ok;
+}
+
+/* builds a bvh over every triangle in a room, on as many threads as
+ * room_setThreads allows; the room may be modified or freed afterward
+ */
+struct room_bvh *room_bvhBuild(struct room *room)
+{
+	struct room_bvh *bvh = calloc(1, sizeof(*bvh));
+	struct bvhBuild b = { .bvh = bvh };
+	struct buffer tri = {0};
+	struct bvhTri *src;
+	double traceStart = trace_now();
+	
+	if (!room)
+		return bvh;
+	
+	if (room->spill)
+		die("room_bvhBuild error: room is spilled to disk");
+	
+	bvh_gather(&tri, room->group);
+	src = (struct bvhTri*)tri.data;
+	bvh->triNum = tri.len / sizeof(*src);
+	if (!bvh->triNum)
+		return bvh;
+	
+	b.bounds = malloc(bvh->triNum * sizeof(*b.bounds));
+	b.centroid = malloc(bvh->triNum * sizeof(*b.centroid));
+	b.order = malloc(bvh->triNum * sizeof(*b.order));
+	for (int i = 0; i < bvh->triNum; ++i)
+	{
+		for (int k = 0; k < 3; ++k)
+		{
+			b.bounds[i][0][k] = fminf(src[i].v[0][k], fminf(src[i].v[1][k], src[i].v[2][k]));
+			b.bounds[i][1][k] = fmaxf(src[i].v[0][k], fmaxf(src[i].v[1][k], src[i].v[2][k]));
+			b.centroid[i][k] = (b.bounds[i][0][k] + b.bounds[i][1][k]) * 0.5f;
+		}
+		b.order[i] = i;
+	}
+	
+	b.threadsLeft = sgThreads;
+	if (b.threadsLeft <= 0)
+		b.threadsLeft = sysconf(_SC_NPROCESSORS_ONLN);
+	b.threadsLeft -= 1; /* this one */
+	pthread_mutex_init(&b.lock, 0);
+	
+	/* a binary tree with at most one triangle per leaf has 2n - 1 nodes */
+	bvh->node = malloc((2 * bvh->triNum - 1) * sizeof(*bvh->node));
+	bvh->nodeNum = 1;
+	bvh_buildNode(&b, 0, 0, bvh->triNum, 0);
+	pthread_mutex_destroy(&b.lock);
+	
+	/* store triangles in leaf order */
+	bvh->tri = malloc(bvh->triNum * sizeof(*bvh->tri));
+	bvh->triIndex = b.order;
+	for (int i = 0; i < bvh->triNum; ++i)
+		bvh->tri[i] = src[b.order[i]];
+	
+	Log("bvh: %d triangles in %d nodes", bvh->triNum, bvh->nodeNum);
+	trace_span("bvh build", traceStart, 0);
+	
+	buffer_free(&tri);
+	free(b.bounds);
+	free(b.centroid);
+	
+	return bvh;
+}
+
+void room_bvhFree(struct room_bvh *bvh)
+{
+	if (!bvh)
+		return;
+	
+	free(bvh->node);
+	free(bvh->tri);
+	free(bvh->triIndex);
+	free(bvh);
+}
+
+/* finds the first triangle along a ray, within maxDist of origin;
+ * dir needn't be normalized, but hit->dist is in world units
+ */
+bool room_bvhRaycast(const struct room_bvh *bvh, const float origin[3], const float dir[3], float maxDist, struct room_hit *hit)
+{
+	int stack[BVH_DEPTH_MAX + 1];
+	int stackNum = 0;
+	float len = sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+	float d[3];
+	float inv[3];
+	int best = -1;
+	
+	if (!bvh || !bvh->triNum || len <= 0)
+		return false;
+	
+	for (int i = 0; i < 3; ++i)
+	{
+		d[i] = dir[i] / len;
+		inv[i] = 1 / d[i];
+	}
+	
+	stack[stackNum++] = 0;
+	while (stackNum)
 	{
-		for (int y = 0; y < div; ++y)
+		const struct bvhNode *n = &bvh->node[stack[--stackNum]];
+		
+		if (!bvh_rayBox(n, origin, inv, maxDist))
+			continue;
+		
+		if (n->num)
 		{
-			for (int z = 0; z < div; ++z)
+			for (int i = n->first; i < n->first + n->num; ++i)
 			{
-				//struct triangle *prev = g->tri;
-				struct triangle *next = 0;
-				struct group *child = calloc(1, sizeof(*child));
-				struct bbox bb = {
-					.xmin = bbox->xmin + sec * x,
-					.ymin = bbox->ymin + sec * y,
-					.zmin = bbox->zmin + sec * z
-				};
-				bb.xmax = bb.xmin + sec;
-				bb.ymax = bb.ymin + sec;
-				bb.zmax = bb.zmin + sec;
-				
-				/* setup */
-				child->bbox = bb;
-				for (struct triangle *t = g->tri; t; t = next)
-				{
-					next = t->next;
-					if (next)
-					{
-						if (triangle_inside_bbox(*next, bb))
-						{
-							void *nnext = next->next;
-							
-							next->next = child->tri;
-							child->tri = next;
-							
-							t->next = nnext;
-							next = t;
-						}
-					}
-					#if 0 /* XXX misc old experments */
-					else if (triangle_inside_bbox(*t, bb))
-					{
-						Log("match");
-					}
-					continue;
-					if (triangle_inside_bbox(*t, bb))
-					{
-						if (prev)
-						{
-							if (prev == g->tri)
-								g->tri = next;
-							else
-								prev->next = next;
-						}
-						t->next = child->tri;
-						child->tri = t;
-					}
-					else
-						prev = t;
-					#endif
-				}
+				float t = bvh_rayTri(&bvh->tri[i], origin, d);
 				
-				/* debug helper: add 3D bbox to output */
-				if (false)
+				if (t >= 0 && t <= maxDist)
 				{
-					struct triangle *t;
-					#define QVTX(X, Y, Z) (struct vertex){bb.X, bb.Y, bb.Z, {0}}
-					struct vertex v[] = {
-						QVTX(xmax, ymin, zmin),
-						QVTX(xmax, ymin, zmax),
-						QVTX(xmin, ymin, zmax),
-						QVTX(xmin, ymin, zmin),
-						QVTX(xmax, ymax, zmin),
-						QVTX(xmax, ymax, zmax),
-						QVTX(xmin, ymax, zmax),
-						QVTX(xmin, ymax, zmin)
-					};
-					#define PUSH_TRI(A, B, C) \
-						t = calloc(1, sizeof(*t)); \
-						t->next = child->tri; \
-						t->v[0] = v[A - 1]; \
-						t->v[1] = v[B - 1]; \
-						t->v[2] = v[C - 1]; \
-						child->tri = t;
-					PUSH_TRI(2, 4, 1)
-					PUSH_TRI(8, 6, 5)
-					PUSH_TRI(5, 2, 1)
-					PUSH_TRI(6, 3, 2)
-					PUSH_TRI(3, 8, 4)
-					PUSH_TRI(1, 8, 5)
-					PUSH_TRI(2, 3, 4)
-					PUSH_TRI(8, 7, 6)
-					PUSH_TRI(5, 6, 2)
-					PUSH_TRI(6, 7, 3)
-					PUSH_TRI(3, 7, 8)
-					PUSH_TRI(1, 4, 8)
-					#undef PUSH_TRI
-					#undef QVTX
+					maxDist = t;
+					best = i;
 				}
-				
-				/* link in */
-				child->next = g->child;
-				g->child = child;
-				
-				/* subdivide */
-				if (divisionsNum > 1)
-					group_divide(child, &bb, divisions + 1, divisionsNum - 1);
 			}
 		}
+		else
+		{
+			/* visit the nearer child first */
+			bool flip = d[0] * (bvh->node[n->first + 1].min[0] - bvh->node[n->first].min[0])
+				+ d[1] * (bvh->node[n->first + 1].min[1] - bvh->node[n->first].min[1])
+				+ d[2] * (bvh->node[n->first + 1].min[2] - bvh->node[n->first].min[2])
+				< 0
+			;
+			
+			stack[stackNum++] = n->first + !flip;
+			stack[stackNum++] = n->first + flip;
+		}
+	}
+	
+	if (best < 0)
+		return false;
+	
+	if (hit)
+	{
+		hit->dist = maxDist;
+		hit->tri = bvh->triIndex[best];
+		for (int i = 0; i < 3; ++i)
+			hit->pos[i] = origin[i] + d[i] * maxDist;
+	}
+	
+	return true;
+}
+
+/* finds every triangle touching a box; returns how many there are,
+ * storing up to triMax of their indices in tri
+ */
+int room_bvhOverlap(const struct room_bvh *bvh, const float min[3], const float max[3], int *tri, int triMax)
+{
+	int stack[BVH_DEPTH_MAX + 1];
+	int stackNum = 0;
+	float c[3];
+	float h[3];
+	int num = 0;
+	
+	if (!bvh || !bvh->triNum)
+		return 0;
+	
+	for (int i = 0; i < 3; ++i)
+	{
+		c[i] = (min[i] + max[i]) * 0.5f;
+		h[i] = (max[i] - min[i]) * 0.5f;
+	}
+	
+	stack[stackNum++] = 0;
+	while (stackNum)
+	{
+		const struct bvhNode *n = &bvh->node[stack[--stackNum]];
+		
+		if (n->min[0] > max[0] || n->max[0] < min[0]
+			|| n->min[1] > max[1] || n->max[1] < min[1]
+			|| n->min[2] > max[2] || n->max[2] < min[2]
+		)
+			continue;
+		
+		if (!n->num)
+		{
+			stack[stackNum++] = n->first;
+			stack[stackNum++] = n->first + 1;
+			continue;
+		}
+		
+		for (int i = n->first; i < n->first + n->num; ++i)
+		{
+			if (!bvh_triBox(&bvh->tri[i], c, h))
+				continue;
+			
+			if (tri && num < triMax)
+				tri[num] = bvh->triIndex[i];
+			num += 1;
+		}
 	}
+	
+	return num;
 }
 
-static void group_free(struct group *g)
+/* finds the triangle closest to a point, within maxDist of it */
+bool room_bvhNearest(const struct room_bvh *bvh, const float point[3], float maxDist, struct room_hit *hit)
 {
-	struct triangle *tNext = 0;
-	struct group *gNext = 0;
+	int stack[BVH_DEPTH_MAX + 1];
+	int stackNum = 0;
+	float bestSq = maxDist * maxDist;
+	float bestPos[3];
+	int best = -1;
 	
-	for ( ; g; g = gNext)
+	if (!bvh || !bvh->triNum)
+		return false;
+	
+	stack[stackNum++] = 0;
+	while (stackNum)
 	{
-		gNext = g->next;
+		const struct bvhNode *n = &bvh->node[stack[--stackNum]];
 		
-		for (struct triangle *t = g->tri; t; t = tNext)
+		if (bvh_boxDistSq(n, point) > bestSq)
+			continue;
+		
+		if (n->num)
 		{
-			tNext = t->next;
+			for (int i = n->first; i < n->first + n->num; ++i)
+			{
+				float p[3];
+				float dSq = 0;
+				
+				bvh_closest(&bvh->tri[i], point, p);
+				for (int k = 0; k < 3; ++k)
+					dSq += (p[k] - point[k]) * (p[k] - point[k]);
+				
+				if (dSq <= bestSq)
+				{
+					bestSq = dSq;
+					best = i;
+					memcpy(bestPos, p, sizeof(bestPos));
+				}
+			}
+		}
+		else
+		{
+			/* visit the nearer child first */
+			float a = bvh_boxDistSq(&bvh->node[n->first], point);
+			float b = bvh_boxDistSq(&bvh->node[n->first + 1], point);
 			
-			free(t);
+			stack[stackNum++] = n->first + (a < b);
+			stack[stackNum++] = n->first + (a >= b);
 		}
-		
-		if (g->child)
-			group_free(g->child);
-		
-		free(g);
 	}
-}
-#endif // private helpers
-
-// public functions
-#if 1
-/* merges all groups into one */
-void room_flatten(struct room *room)
-{
-	struct group *dst;
-	struct group *next = 0;
 	
-	if (!room || !(dst = room->group))
-		return;
+	if (best < 0)
+		return false;
 	
-	for (struct group *src = dst->next; src; src = next)
+	if (hit)
 	{
-		next = src->next;
-		group_merge(dst, src);
+		hit->dist = sqrtf(bestSq);
+		hit->tri = bvh->triIndex[best];
+		memcpy(hit->pos, bestPos, sizeof(bestPos));
 	}
 	
-	dst->next = 0;
+	return true;
 }
 
-/* divide a flattened room into nested group structure */
-void room_divide(struct room *room, const int divisions[], const int divisionsNum)
+/* compiles every group the way room_writeZroom would with opt,
+ * keeping only each one's bounds and cost, for room_cullFrame to
+ * replay cameras
+ */
+struct room_cull *room_cullBegin(struct room *room, const struct room_writeOptions *opt)
 {
-	struct bbox bbox;
+	struct room_cull *cull = calloc(1, sizeof(*cull));
+	struct zroomGroup *group;
 	
-	if (!room || !divisions || divisionsNum <= 0 || !room->group)
-		return;
+	if (!room)
+		return cull;
 	
-	// TODO: do I want a fatal error here, or just a warning + invoke room_flatten?
-	if (room->group->next)
-		die("room_divide error: trying to divide a non-flattened room");
+	if (room->spill)
+		die("room_cullBegin error: room is spilled to disk");
 	
-	bbox = group_bounds(room->group);
+	group = zroomCompileTree(room->group, true, opt ? opt : &sgWriteDefaults, &cull->groupNum);
+	cull->group = calloc(cull->groupNum + 1, sizeof(*cull->group));
+	for (int i = 0; i < cull->groupNum; ++i)
+	{
+		struct zroomGroup *c = &group[i];
+		struct cullGroup *dst = &cull->group[i];
+		
+		cull_groupBounds(c->g, dst->min, dst->max);
+		dst->stats.groups = 1;
+		dst->stats.tris = c->triNum;
+		dst->stats.cmds = c->cmds;
+		dst->stats.loads = c->loads;
+		dst->stats.dlBytes = c->dl.len + c->sub.len;
+		
+		zroomGroupFree(c);
+	}
+	free(group);
 	
-	group_divide(room->group, &bbox, divisions, divisionsNum);
+	return cull;
 }
 
-/* merges src into dst (src will be destroyed) */
-void room_merge(struct room *dst, struct room *src)
+/* sums the cost of every group whose bounds intersect the camera's
+ * view frustum; with no camera, sums every group
+ */
+void room_cullFrame(const struct room_cull *cull, const struct room_camera *cam, struct room_cullStats *dst)
 {
-	if (!dst || !src)
+	float plane[6][4];
+	
+	memset(dst, 0, sizeof(*dst));
+	
+	if (!cull)
 		return;
 	
-	for (struct material *m = dst->mat; m; m = m->next)
-	{
-		if (!m->next)
-		{
-			m->next = src->mat;
-			break;
-		}
-	}
+	if (cam)
+		cull_frustum(cam, plane);
 	
-	for (struct group *g = dst->group; g; g = g->next)
+	for (int i = 0; i < cull->groupNum; ++i)
 	{
-		if (!g->next)
-		{
-			g->next = src->group;
-			break;
-		}
+		const struct cullGroup *g = &cull->group[i];
+		
+		if (cam && !cull_boxVisible(plane, g->min, g->max))
+			continue;
+		
+		dst->groups += g->stats.groups;
+		dst->tris += g->stats.tris;
+		dst->cmds += g->stats.cmds;
+		dst->loads += g->stats.loads;
+		dst->dlBytes += g->stats.dlBytes;
 	}
+}
+
+void room_cullFree(struct room_cull *cull)
+{
+	if (!cull)
+		return;
 	
-	free(src);
+	free(cull->group);
+	free(cull);
 }
 
-/* loads a room */
-struct room *room_load(const char *fn)
+/* chooses cells per axis in proportion to a room's bounds, so that
+ * there are about cells of them, each roughly a cube; a room that is
+ * already about a cube gets a cube division
+ */
+struct room_division room_aspectDivision(struct room *room, int cells)
 {
-	size_t len = 0;
-	struct room *room = calloc(1, sizeof(*room));
-	uint8_t *data = loadfile(fn, &len);
-	uint8_t *meshHeader = 0;
+	struct room_division div = { { 1, 1, 1 }, false };
+	struct bbox bb;
+	float len[3];
+	float lo = 0;
+	float hi;
 	
-	if (!data)
-		die("failed to load room file '%s'", fn);
-	sgRoomSegment = data;
+	if (!room || cells <= 1)
+		return div;
 	
-	/* find mesh header */
-	for (size_t i = 0; i < len - 8 && data[i] != 0x14; i += 8)
-		if (data[i] == 0x0A)
-			meshHeader = segmentReadP(data + i + 4);
-	if (!meshHeader)
-		die("failed to locate mesh header in room '%s'", fn);
+	bb = room->spill ? room->spillBounds : group_bounds(room->group);
+	len[0] = max_int(bb.xmax - bb.xmin, 0);
+	len[1] = max_int(bb.ymax - bb.ymin, 0);
+	len[2] = max_int(bb.zmax - bb.zmin, 0);
+	hi = fmaxf(len[0], fmaxf(len[1], len[2]));
+	if (hi <= 0)
+		return div;
 	
-	/* parse mesh header */
+	/* find the cell size at which the counts multiply to cells */
+	for (int i = 0; i < 32; ++i)
 	{
-		uint8_t *s = segmentReadP(meshHeader + 4);
-		uint8_t *e = segmentReadP(meshHeader + 8);
-		const int stride = 16;
-		uint8_t num = meshHeader[1];
+		float size = (lo + hi) * 0.5f;
+		float num = 1;
 		
-		if (*meshHeader != 0x02)
-			die("only mesh header type 0x02 supported; '%s' type is %02x'"
-				, fn, *meshHeader
-			);
-		
-		/* unnecessary sanity check */
-		if ((e - s) / stride != num)
-			die("mesh header sanity check failed");
+		for (int k = 0; k < 3; ++k)
+			num *= fmaxf(1, len[k] / size);
 		
-		while (s < e)
-		{
-			appendDL(room, segmentReadP(s + 8));
-			appendDL(room, segmentReadP(s + 12));
-			
-			s += stride;
-		}
+		if (num > cells)
+			lo = size;
+		else
+			hi = size;
 	}
 	
-	free(data);
+	for (int k = 0; k < 3; ++k)
+		div.n[k] = max_int(1, (int)(len[k] / hi + 0.5f));
+	div.cube = div.n[0] == div.n[1] && div.n[1] == div.n[2];
 	
-	return room;
+	return div;
 }
 
-/* cleanup */
-void room_free(struct room *room)
+/* tries many division schemes on copies of a flattened room, across
+ * threads, and divides the room with the cheapest; its levels go to
+ * divisions, and their count is returned
+ */
+int room_divideAuto(struct room *room, struct room_division divisions[], const int divisionsMax)
 {
-	struct material *mNext = 0;
+	struct buffer list = {0};
+	struct autoJobs jobs = {0};
+	float plane[AUTO_CAMERAS][6][4];
+	pthread_t thread[64];
+	int threadNum = sgThreads;
+	struct autoCandidate *best;
+	struct bbox bbox;
+	int divNum;
 	
-	if (!room)
-		return;
+	if (!room || !room->group || !divisions || divisionsMax <= 0)
+		return 0;
 	
-	group_free(room->group);
-		
-	for (struct material *m = room->mat; m; m = mNext)
+	if (room->group->next)
+		die("room_divideAuto error: trying to divide a non-flattened room");
+	
+	bbox = group_bounds(room->group);
+	auto_cameras(&bbox, plane);
+	
+	/* cubes, then cells shaped like the room */
+	auto_candidates(&list, (struct autoCandidate){0}, 1);
+	for (int cells = 8; cells <= AUTO_CELLS_MAX * AUTO_CELLS_MAX; cells *= 2)
 	{
-		mNext = m->next;
-		
-		if (m->data)
-			free(m->data);
+		struct autoCandidate c = { .divNum = 1 };
 		
-		free(m);
+		c.div[0] = room_aspectDivision(room, cells);
+		if (!c.div[0].cube)
+			buffer_write(&list, &c, sizeof(c));
 	}
+	jobs.cand = (struct autoCandidate*)list.data;
+	jobs.candNum = list.len / sizeof(*jobs.cand);
+	jobs.src = room->group;
+	jobs.plane = plane;
 	
-	free(room);
-}
-
-/* write a room to wavefront */
-void room_writeWavefront(struct room *room, struct group *group, const char *outfn)
-{
-	static FILE *fp = 0; /* XXX statics to support recursion */
-	static int v = 1;
-	bool ownsFp = false;
+	if (threadNum <= 0)
+		threadNum = sysconf(_SC_NPROCESSORS_ONLN);
+	threadNum = min_int(threadNum, sizeof(thread) / sizeof(*thread));
+	threadNum = min_int(threadNum, jobs.candNum);
 	
-	/* initial load */
-	if (fp == 0)
+	pthread_mutex_init(&jobs.lock, 0);
+	if (threadNum <= 1)
+		auto_worker(&jobs);
+	else
 	{
-		if (!room
-			|| !outfn
-			|| !(fp = fopen(outfn, "wb"))
-		)
-			return;
-		
-		v = 1; /* wavefront vertex indexing starts at 1 */
-		ownsFp = true;
+		for (int i = 0; i < threadNum; ++i)
+			if (pthread_create(&thread[i], 0, auto_worker, &jobs))
+				die("failed to create thread");
+		for (int i = 0; i < threadNum; ++i)
+			pthread_join(thread[i], 0);
 	}
+	pthread_mutex_destroy(&jobs.lock);
 	
-	/* write every group */
-	for (struct group *g = group ? group : room->group; g; g = g->next)
+	qsort(jobs.cand, jobs.candNum, sizeof(*jobs.cand), auto_compare);
+	
+	Log("divide auto: %d schemes, per frame averaged over %d cameras:", jobs.candNum, AUTO_CAMERAS);
+	Log("  rank  scheme    entries      cost  groups  triangles   G_VTX  vertices");
+	for (int i = 0; i < jobs.candNum; ++i)
 	{
-		fprintf(fp, "g %p\n", (void*)g);
+		const struct autoCandidate *c = &jobs.cand[i];
+		char scheme[32] = "";
 		
-		for (struct triangle *t = g->tri; t; t = t->next)
+		if (!c->divNum)
+			strcpy(scheme, "none");
+		for (int k = 0; k < c->divNum; ++k)
 		{
-			for (int i = 0; i < 3; ++i)
-				fprintf(fp, "v %d %d %d\n"
-					, t->v[i].x, t->v[i].y, t->v[i].z
+			const int *n = c->div[k].n;
+			
+			if (c->div[k].cube)
+				snprintf(scheme + strlen(scheme), sizeof(scheme) - strlen(scheme)
+					, k ? ",%d" : "%d", n[0]
+				);
+			else
+				snprintf(scheme + strlen(scheme), sizeof(scheme) - strlen(scheme)
+					, k ? ",%dx%dx%d" : "%dx%dx%d", n[0], n[1], n[2]
 				);
-			fprintf(fp, "f %d %d %d\n", v, v + 1, v + 2);
-			v += 3;
 		}
 		
-		/* recursion */
-		if (g->child)
-			room_writeWavefront(0, g->child, 0);
+		Log("  %4d  %-8s  %7d  %8.0f  %6.1f  %9.1f  %6.1f  %8.1f%s"
+			, i + 1, scheme, c->entries, c->cost
+			, c->groups, c->tris, c->cmds, c->loads
+			, c->entries > UINT8_MAX ? "  (too many entries)" : ""
+		);
 	}
 	
-	/* initial load */
-	if (ownsFp)
-	{
-		fclose(fp);
-		fp = 0;
-	}
+	best = &jobs.cand[0];
+	if (best->entries > UINT8_MAX)
+		die("room_divideAuto error: no scheme fits in a mesh header");
+	
+	divNum = min_int(best->divNum, divisionsMax);
+	memcpy(divisions, best->div, divNum * sizeof(*divisions));
+	room_divide(room, divisions, divNum);
+	
+	buffer_free(&list);
+	
+	return divNum;
 }
 
-/* write a room to zroom format */
-void room_writeZroom(struct room *room, const char *outfn, bool withMaterials)
+/* loads a wavefront obj file as a room: each 'g' or 'o' statement
+ * starts a group, polygons are triangulated as fans, and positions
+ * are multiplied by scale and rounded; faces get the same material
+ * every loaded room uses for now; on failure, releases everything
+ * it built before dying
+ */
+static void objLoadRun(void *arg)
 {
-	const uint8_t enddl[8] = { G_ENDDL };
-	struct vertex vbuf[VBUF_MAX];
-	struct material *mat = 0;
-	FILE *fp;
-	int vbufIndex = 0;
-	int opaNum = 0;
-	unsigned char roomHeader[] = {
-		0x16, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x08, 0x00, 0x00, 0x00,	0x00, 0x00, 0x00, 0x00,
-		0x12, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x10, 0x00, 0x00, 0x00, 0xFF, 0xFF, 0x0A, 0x00,
-		0x0A, 0x00, 0x00, 0x00,	0x03, 0x00, 0x00, 0x00,
-		0x05, 0x00, 0x00, 0x00, 0x0F, 0x28, 0x6D, 0xBE,
-		0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		0x00, 0x00, 0x00, 0x00,	0x00, 0x00, 0x00, 0x00
-	};
+	struct roomLoad *l = arg;
+	const char *fn = l->fn;
+	struct objImport im = { .scale = l->scale };
+	struct room *room = calloc(1, sizeof(*room));
+	struct buffer pos = {0};
+	struct buffer col = {0};
+	struct buffer tex = {0};
+	struct buffer nrm = {0};
+	struct group **gTail = &room->group;
+	struct group *g = 0;
+	struct triangle **tTail = 0;
+	bool startGroup = false;
+	int threadNum = sgThreads;
+	int groupNum = 0;
+	int triNum = 0;
+	double traceStart = trace_now();
+	size_t len = 0;
+	char *data = loadfile(fn, &len);
+	char error[1024] = "";
+	const char *p;
 	
-	if (!room
-		|| !outfn
-		|| !(fp = fopen(outfn, "wb+"))
-	)
-		return;
+	if (!data)
+	{
+		free(room);
+		die("failed to load obj file '%s'", fn);
+	}
 	
-	/* write placeholder room header */
-	fwrite(roomHeader, 1, sizeof(roomHeader), fp);
+	/* every line ends in a newline */
+	data = realloc(data, len + 1);
+	data[len] = '\n';
+	p = data;
 	
-	/* write every material */
-	if (withMaterials)
-		writeMaterials(room, fp);
+	if (threadNum <= 0)
+		threadNum = sysconf(_SC_NPROCESSORS_ONLN);
+	im.chunkNum = max_int(1, len / OBJ_CHUNK_MIN < (size_t)threadNum * 4 ? (int)(len / OBJ_CHUNK_MIN) : threadNum * 4);
+	im.chunk = calloc(im.chunkNum, sizeof(*im.chunk));
+	im.mat = appendMaterial(room, 0, 0);
+	pthread_mutex_init(&im.lock, 0);
 	
-	/* write every group */
-	for (struct group *g = room->group; g; g = g->next, ++opaNum)
+	/* split at line breaks near even intervals */
+	for (int i = 0; i < im.chunkNum; ++i)
 	{
-		struct triangle *tBegin = g->tri;
-		FILE *dl;
-		size_t dlLen;
+		const char *stop = data + len + 1;
+		const char *end = data + (len + 1) * (i + 1) / im.chunkNum;
 		
-		if (!(dl = tmpfile()))
-			die("failed to create tmpfile");
-		
-		Log("processing group %p...", (void*)g);
-		
-		/* triangle data first */
-		for (struct triangle *t = tBegin; t; t = t->next)
-		{
-			int vbufIndexOld = vbufIndex;
-			bool didJump = false;
-			
-			if (withMaterials && t->mat != mat)
-			{
-				mat = t->mat;
-				
-				if (t != tBegin)
-				{
-					didJump = true;
-					goto L_flush;
-				}
-			L_postFlushJump:
-				didJump = false;
-				uint32_t a = mat->wroteAt;
-				uint8_t branch[8] = { G_DL, 0, 0, 0, a >> 24, a >> 16, a >> 8, a };
-				
-				fwrite(branch, 1, sizeof(branch), dl);
-			}
-			
-			/* retry in perpetuity until it fits */
-			for (int i = 0; i < 3; )
-			{
-				while (i < 3)
-				{
-					/* doesn't fit */
-					if ((t->vbidx[i] = vbufGetVertexIndex(vbuf, &vbufIndex, t->v[i])) < 0)
-					{
-					L_flush:do{}while(0);
-						uint32_t addr = 0x03000000 | ftell(fp);
-						
-						/* flush compiled vertex buffer to file */
-						for (i = 0; i < vbufIndexOld; ++i)
-						{
-							struct vertex *v = vbuf + i;
-							uint8_t result[16];
-							
-							memcpy(result, v, sizeof(*v));
-							BEw16(result + 0, v->x);
-							BEw16(result + 2, v->y);
-							BEw16(result + 4, v->z);
-							
-							fwrite(result, 1, sizeof(result), fp);
-						}
-						
-						/* flush vertex load command to display list */
-						{
-							uint8_t cmd[8] = {
-								G_VTX
-								, vbufIndexOld >> 4
-								, vbufIndexOld << 4
-								, ((0 + vbufIndexOld) & 0x7f) << 1
-								, addr >> 24, addr >> 16, addr >> 8, addr
-							};
-							
-							fwrite(cmd, 1, sizeof(cmd), dl);
-							vbufIndex = 0;
-						}
-						
-						/* flush triangles to display list */
-						{
-							for (struct triangle *w = tBegin; w != t && w; w = w->next)
-							{
-								struct triangle *n = w->next != t ? w->next : 0;
-								uint8_t cmd[8] = {
-									G_TRI
-									, w->vbidx[0] << 1
-									, w->vbidx[1] << 1
-									, w->vbidx[2] << 1
-								};
-								
-								if (n)
-									cmd[0] = G_TRI2
-									, cmd[5] = n->vbidx[0] << 1
-									, cmd[6] = n->vbidx[1] << 1
-									, cmd[7] = n->vbidx[2] << 1
-									, w = n
-								;
-								
-								fwrite(cmd, 1, sizeof(cmd), dl);
-							}
-							
-							tBegin = t;
-						}
-						
-						if (didJump)
-							goto L_postFlushJump;
-						
-						if (!t->next)
-							goto L_triangleDataDone;
-						
-						i = 0;
-					}
-					else
-						++i;
-				}
-			}
-			
-			/* flush any remaining triangles */
-			if (!t->next)
-				goto L_flush;
-			L_triangleDataDone:do{}while(0);
-		}
+		if (end > p)
+			end = (const char*)memchr(end - 1, '\n', stop - (end - 1)) + 1;
+		else
+			end = p;
 		
-		g->wroteAt = 0x03000000 | ftell(fp);
-		Log(" > writing it at %08x", g->wroteAt);
+		im.chunk[i].begin = p;
+		im.chunk[i].end = end;
+		p = end;
+	}
+	
+	/* parse, then give each chunk the global index of its first vertex */
+	obj_runPass(&im, 0, threadNum);
+	for (int i = 0; i < im.chunkNum; ++i)
+	{
+		struct objChunk *c = &im.chunk[i];
 		
-		/* append dl's contents onto fp */
-		fwrite(enddl, 1, sizeof(enddl), dl);
-		dlLen = ftell(dl);
-		fseek(dl, 0, SEEK_SET);
-		while(dlLen--)
-			fputc(fgetc(dl), fp);
-		fclose(dl);
+		c->posBase = pos.len / sizeof(float[3]);
+		c->texBase = tex.len / sizeof(float[2]);
+		c->nrmBase = nrm.len / sizeof(float[3]);
+		buffer_write(&pos, c->pos.data, c->pos.len);
+		buffer_write(&col, c->col.data, c->col.len);
+		buffer_write(&tex, c->tex.data, c->tex.len);
+		buffer_write(&nrm, c->nrm.data, c->nrm.len);
+		buffer_free(&c->pos);
+		buffer_free(&c->col);
+		buffer_free(&c->tex);
+		buffer_free(&c->nrm);
 	}
+	im.pos = (const float(*)[3])pos.data;
+	im.col = (const float(*)[3])col.data;
+	im.tex = (const float(*)[2])tex.data;
+	im.nrm = (const float(*)[3])nrm.data;
+	im.posNum = pos.len / sizeof(float[3]);
+	im.texNum = tex.len / sizeof(float[2]);
+	im.nrmNum = nrm.len / sizeof(float[3]);
 	
-	/* write mesh header */
+	/* build triangles, unless parsing failed */
+	for (int i = 0; i < im.chunkNum; ++i)
+		if (im.chunk[i].error)
+			im.pass = -1;
+	if (im.pass == 0)
+		obj_runPass(&im, 1, threadNum);
+	pthread_mutex_destroy(&im.lock);
+	
+	/* describe the first failure while the text is at hand */
+	for (int i = 0; i < im.chunkNum && !*error; ++i)
 	{
-		const int type = 0x00;
-		const int stride = (type == 0x00) ? 8 : 16;
-		uint32_t wroteAt = 0x03000000 | ftell(fp);
-		uint32_t start = wroteAt + 12;
-		uint32_t end = start + opaNum * stride;
-		uint8_t meshHeader[] = {
-			type // type
-			, opaNum // number of entries
-			, 0 // padding
-			, 0 // padding
-			, U32_BYTES(start)
-			, U32_BYTES(end)
-		};
+		struct objChunk *c = &im.chunk[i];
+		int line = 1;
 		
-		/* main header structure */
-		fwrite(meshHeader, 1, sizeof(meshHeader), fp);
+		if (!c->error)
+			continue;
 		
-		/* the mesh pointer array referenced by the header */
-		for (struct group *g = room->group; g; g = g->next)
+		if (!c->errorAt)
+			snprintf(error, sizeof(error), "'%s': %s", fn, c->error);
+		else
 		{
-			if (type == 0x00)
-			{
-				uint8_t tmp[4] = { U32_BYTES(g->wroteAt) };
-				uint8_t zero[4] = { 0 };
-				
-				fwrite(tmp, 1, sizeof(tmp), fp); // opa
-				fwrite(zero, 1, sizeof(zero), fp); // xlu
-			}
-			else if (type == 0x02)
-			{
-				// TODO
-			}
+			for (const char *q = data; q < c->errorAt; ++q)
+				line += *q == '\n';
+			snprintf(error, sizeof(error), "'%s' line %d: %s", fn, line, c->error);
 		}
+	}
+	
+	/* link each chunk's runs of triangles into groups, in file order */
+	for (int i = 0; i < im.chunkNum; ++i)
+	{
+		struct objChunk *c = &im.chunk[i];
 		
-		/* 16-byte alignment */
-		while (ftell(fp) & 0xf)
-			fputc(0, fp);
-		
-		/* update room header to point to mesh header */
+		for (int k = 0; k < c->segNum; ++k)
 		{
-			uint8_t tmp[4] = { U32_BYTES(wroteAt) };
+			struct objSegment *s = &c->seg[k];
+			
+			startGroup |= s->newGroup;
+			if (!s->head)
+				continue;
+			
+			if (!g || startGroup)
+			{
+				g = calloc(1, sizeof(*g));
+				*gTail = g;
+				gTail = &g->next;
+				tTail = &g->tri;
+				startGroup = false;
+				groupNum += 1;
+			}
 			
-			fseek(fp, 0, SEEK_SET);
-			while (fgetc(fp) != 0x0A)
-				fseek(fp, 7, SEEK_CUR);
-			fseek(fp, 3, SEEK_CUR);
-			fwrite(tmp, 1, sizeof(tmp), fp);
+			*tTail = s->head;
+			tTail = s->tail;
 		}
+		
+		triNum += c->triNum;
+		buffer_free(&c->corner);
+		buffer_free(&c->face);
+		buffer_free(&c->groupAt);
+		free(c->seg);
+	}
+	
+	buffer_free(&pos);
+	buffer_free(&col);
+	buffer_free(&tex);
+	buffer_free(&nrm);
+	free(im.chunk);
+	free(data);
+	
+	/* whatever was built belongs to room by now */
+	if (*error)
+	{
+		room_free(room);
+		die("%s", error);
 	}
 	
-	fclose(fp);
+	Log("'%s': %d triangles from %d vertices in %d groups", fn, triNum, im.posNum, groupNum);
+	trace_span("obj import", traceStart, fn);
+	
+	l->room = room;
+}
+
+/* loads a wavefront obj file as a room (see objLoadRun); returns 0
+ * if it can't, and room_error() says why
+ */
+struct room *room_loadObj(const char *fn, float scale)
+{
+	struct roomLoad l = { .fn = fn, .scale = scale };
+	
+	if (!roomTry(objLoadRun, &l))
+		return 0;
+	
+	return l.room;
 }
 #endif // public functions
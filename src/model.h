@@ -9,6 +9,7 @@
 #define MODEL_H_INCLUDED 1
 
 #include <stdbool.h>
+#include <stddef.h>
 
 struct bbox;
 struct material;
@@ -16,13 +17,112 @@ struct vertex;
 struct triangle;
 struct group;
 struct room;
+struct room_bvh;
+struct room_cull;
+
+/* result of a bvh query; tri counts triangles depth first through
+ * the room's groups, in the order room_writeWavefront lists them
+ */
+struct room_hit
+{
+	float dist;
+	float pos[3];
+	int tri;
+};
+
+/* a viewpoint for room_cullFrame; fovy is vertical, in degrees */
+struct room_camera
+{
+	float pos[3];
+	float target[3];
+	float fovy;
+	float aspect;
+	float near;
+	float far;
+};
+
+/* work the rsp would do drawing some of a room's groups */
+struct room_cullStats
+{
+	int groups;
+	int tris;
+	int cmds; /* G_VTX commands */
+	int loads; /* vertices loaded */
+	int dlBytes;
+};
+
+/* what room_info finds in a room file */
+struct room_info
+{
+	int meshType;
+	int entries; /* in the mesh header */
+	int dlNum; /* distinct display lists */
+	int dlBytes; /* of those */
+	int vtxCmds; /* as drawn, counting every call of a shared list */
+	int vtxLoaded;
+	int vtxUnique;
+	int tris;
+	int materials; /* distinct material setups */
+	int min[3]; /* bounds of every vertex loaded */
+	int max[3];
+};
+
+/* cells along x, y and z at one level of division; a cube division
+ * first stretches the bounds into a cube, as '--divide 4' always has
+ */
+struct room_division
+{
+	int n[3];
+	bool cube;
+};
+
+/* how zroom output is written; a null pointer or all zeroes is plain,
+ * uncompressed output compiled on room_setThreads' threads
+ */
+struct room_writeOptions
+{
+	int threads; /* compile and compress on this many; 0 = room_setThreads' */
+	int yaz0; /* compression effort, 1 to 9; 0 = uncompressed */
+	bool materialDeltas; /* switch materials by inlining only what changes */
+	bool clusters; /* split groups into clusters skipped when out of view */
+	bool layout; /* align to cache lines and keep neighboring groups together */
+};
+
+/* receives output as it is written; returns the number of bytes consumed */
+typedef size_t (*room_writeFunc)(void *udata, const void *data, size_t len);
 
 void room_flatten(struct room *room);
-void room_divide(struct room *room, const int divisions[], const int divisionsNum);
+void room_cleanup(struct room *room);
+void room_divide(struct room *room, const struct room_division divisions[], const int divisionsNum);
+int room_divideAuto(struct room *room, struct room_division divisions[], const int divisionsMax);
+struct room_division room_aspectDivision(struct room *room, int cells);
 void room_merge(struct room *dst, struct room *src);
 struct room *room_load(const char *fn);
+struct room *room_loadFromMemory(const void *data, const size_t len);
+struct room *room_loadRom(const char *fn, const int *which, const int whichNum);
+struct room *room_loadObj(const char *fn, float scale);
+bool room_info(const char *fn, struct room_info *info);
+const char *room_error(void);
 void room_free(struct room *room);
-void room_writeWavefront(struct room *room, struct group *group, const char *outfn);
-void room_writeZroom(struct room *room, const char *outfn, bool withMaterials);
+struct room *room_snapshot(struct room *room);
+bool room_writeWavefront(struct room *room, struct group *group, const char *outfn);
+bool room_writeZroom(struct room *room, const char *outfn, bool withMaterials, const struct room_writeOptions *opt);
+bool room_writeZroomLod(struct room *room, const char *outfn, bool withMaterials, const struct room_writeOptions *opt, float ratio, float maxError);
+void room_setThreads(int threads);
+void *room_writeWavefrontToMemory(struct room *room, size_t *len);
+void room_writeWavefrontToCallback(struct room *room, room_writeFunc write, void *udata);
+void *room_writeZroomToMemory(struct room *room, bool withMaterials, const struct room_writeOptions *opt, size_t *len);
+bool room_writeZroomToCallback(struct room *room, bool withMaterials, const struct room_writeOptions *opt, room_writeFunc write, void *udata);
+void room_spill(struct room *room);
+bool room_writeZroomStreaming(struct room *room, const char *outfn, bool withMaterials, const struct room_writeOptions *opt, const struct room_division divisions[], const int divisionsNum, const size_t budget);
+
+struct room_bvh *room_bvhBuild(struct room *room);
+void room_bvhFree(struct room_bvh *bvh);
+bool room_bvhRaycast(const struct room_bvh *bvh, const float origin[3], const float dir[3], float maxDist, struct room_hit *hit);
+int room_bvhOverlap(const struct room_bvh *bvh, const float min[3], const float max[3], int *tri, int triMax);
+bool room_bvhNearest(const struct room_bvh *bvh, const float point[3], float maxDist, struct room_hit *hit);
+struct room_cull *room_cullBegin(struct room *room, const struct room_writeOptions *opt);
+void room_cullFrame(const struct room_cull *cull, const struct room_camera *cam, struct room_cullStats *dst);
+void room_cullFree(struct room_cull *cull);
 
 #endif /* MODEL_H_INCLUDED */
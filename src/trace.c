@@ -0,0 +1,171 @@
+/*
+ * trace.c <z64.me>
+ *
+ * chrome trace-event timeline output
+ *
+ * spans are collected in memory while tracing is on and written as
+ * json by trace_close; load the result in chrome://tracing or perfetto
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L /* clock_gettime */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "trace.h"
+
+#define THREADS_MAX 64
+
+// private globals
+static bool sgOn = false;
+static char *sgFn = 0;
+static struct buffer sgEvents = {0};
+static pthread_mutex_t sgLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t sgThread[THREADS_MAX];
+static int sgThreadNum = 0;
+
+// private helpers
+#if 1
+/* appends str to the event buffer as the body of a json string */
+static void writeEscaped(const char *str)
+{
+	for ( ; str && *str; ++str)
+	{
+		char tmp[8];
+		
+		if (*str == '"' || *str == '\\')
+			snprintf(tmp, sizeof(tmp), "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			snprintf(tmp, sizeof(tmp), "\\u%04x", *str);
+		else
+			tmp[0] = *str, tmp[1] = '\0';
+		
+		buffer_write(&sgEvents, tmp, strlen(tmp));
+	}
+}
+
+/* small id for the calling thread; call with sgLock held */
+static int threadId(void)
+{
+	pthread_t self = pthread_self();
+	
+	for (int i = 0; i < sgThreadNum; ++i)
+		if (pthread_equal(sgThread[i], self))
+			return i;
+	
+	if (sgThreadNum >= THREADS_MAX)
+		return THREADS_MAX;
+	
+	sgThread[sgThreadNum] = self;
+	return sgThreadNum++;
+}
+#endif // private helpers
+
+// public functions
+#if 1
+/* start recording spans, to be written to fn by trace_close */
+bool trace_open(const char *fn)
+{
+	if (!fn || sgOn)
+		return false;
+	
+	sgFn = Strdup(fn);
+	sgOn = true;
+	trace_threadName("main");
+	
+	return true;
+}
+
+/* write recorded spans and stop recording */
+void trace_close(void)
+{
+	FILE *fp;
+	
+	if (!sgOn)
+		return;
+	
+	sgOn = false;
+	
+	if (!(fp = fopen(sgFn, "wb")))
+		die("failed to write trace '%s'", sgFn);
+	
+	fprintf(fp, "{\"traceEvents\":[\n");
+	if (sgEvents.len)
+		fwrite(sgEvents.data, 1, sgEvents.len - 2, fp); /* trailing ",\n" */
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+	
+	Log("wrote trace '%s'", sgFn);
+	free(sgFn);
+	sgFn = 0;
+	buffer_free(&sgEvents);
+}
+
+bool trace_on(void)
+{
+	return sgOn;
+}
+
+/* microseconds, or 0 when not tracing */
+double trace_now(void)
+{
+	struct timespec ts;
+	
+	if (!sgOn)
+		return 0;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+/* records a span from start (as returned by trace_now) until now */
+void trace_span(const char *name, double start, const char *detail)
+{
+	char tmp[128];
+	double end;
+	
+	if (!sgOn)
+		return;
+	
+	end = trace_now();
+	
+	pthread_mutex_lock(&sgLock);
+		buffer_write(&sgEvents, "{\"name\":\"", 9);
+		writeEscaped(name);
+		snprintf(tmp, sizeof(tmp), "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f"
+			, threadId(), start, end - start
+		);
+		buffer_write(&sgEvents, tmp, strlen(tmp));
+		if (detail)
+		{
+			buffer_write(&sgEvents, ",\"args\":{\"detail\":\"", 19);
+			writeEscaped(detail);
+			buffer_write(&sgEvents, "\"}", 2);
+		}
+		buffer_write(&sgEvents, "},\n", 3);
+	pthread_mutex_unlock(&sgLock);
+}
+
+/* names the calling thread's track */
+void trace_threadName(const char *name)
+{
+	char tmp[128];
+	
+	if (!sgOn)
+		return;
+	
+	pthread_mutex_lock(&sgLock);
+		snprintf(tmp, sizeof(tmp), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\""
+			, threadId()
+		);
+		buffer_write(&sgEvents, tmp, strlen(tmp));
+		writeEscaped(name);
+		buffer_write(&sgEvents, "\"}},\n", 5);
+	pthread_mutex_unlock(&sgLock);
+}
+#endif // public functions
@@ -0,0 +1,20 @@
+/*
+ * trace.h <z64.me>
+ *
+ * chrome trace-event timeline output
+ *
+ */
+
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED 1
+
+#include <stdbool.h>
+
+bool trace_open(const char *fn);
+void trace_close(void);
+bool trace_on(void);
+double trace_now(void);
+void trace_span(const char *name, double start, const char *detail);
+void trace_threadName(const char *name);
+
+#endif /* TRACE_H_INCLUDED */